@@ -23,12 +23,25 @@
  * new_model.c: simple test application
  *
  * This application tests the newly added XOR-TEST module.
- * XOR-TEST module got two registers.
+ * XOR-TEST module got the registers below and a data window.
  * ------------------------------------------------
  * | Register    Offset                           |
  * ------------------------------------------------
  *   Xdata      0x0
  *   Matcher    0x4
+ *   Burst end  0x8
+ *   Ctrl       0xC
+ *   Status     0x10
+ *   Isr        0x14
+ *   Src        0x18 (low), 0x1C (high)
+ *   Len        0x20
+ *   Dst        0x24 (low), 0x28 (high)
+ *   Result     0x2C
+ *   Ring base  0x30 (low), 0x34 (high)
+ *   Ring size  0x38
+ *   Ring head  0x3C
+ *   Ring tail  0x40
+ *   Fifo       0x100 - 0x1FF
  */
 #include <stdio.h>
 #include <stddef.h>
@@ -37,6 +50,51 @@
 #define XOR_TEST_ADDR           0xA0001000
 #define REG_XDATA_OFFSET        0x0
 #define REG_MATCHER_OFFSET      0x4
+#define REG_BURST_END_OFFSET    0x8
+#define REG_CTRL_OFFSET         0xC
+#define REG_STATUS_OFFSET       0x10
+#define REG_ISR_OFFSET          0x14
+#define REG_SRC_LO_OFFSET       0x18
+#define REG_SRC_HI_OFFSET       0x1C
+#define REG_LEN_OFFSET          0x20
+#define REG_DST_LO_OFFSET       0x24
+#define REG_DST_HI_OFFSET       0x28
+#define REG_RESULT_OFFSET       0x2C
+#define REG_RING_BASE_LO_OFFSET 0x30
+#define REG_RING_BASE_HI_OFFSET 0x34
+#define REG_RING_SIZE_OFFSET    0x38
+#define REG_RING_HEAD_OFFSET    0x3C
+#define REG_RING_TAIL_OFFSET    0x40
+#define XOR_FIFO_OFFSET         0x100
+#define XOR_FIFO_SIZE           0x100
+
+#define CTRL_START              0x1
+#define CTRL_IRQ_EN             0x2
+#define STATUS_MATCH            0x2
+#define STATUS_ERROR            0x4
+#define ISR_DONE                0x1
+
+/* Ring descriptor, as the device reads it from memory. */
+typedef struct {
+    uint64_t src;
+    uint32_t len;
+    uint32_t reserved;
+    uint64_t dst;
+    uint32_t result;
+    uint32_t status;
+} XorDesc;
+
+#define DESC_DONE               0x1
+#define DESC_MATCH              0x2
+#define DESC_ERROR              0x4
+
+/* DDR well clear of the program, for the DMA buffers. */
+#define DMA_BUF_ADDR            0x10000000
+#define DMA_BUF_SIZE            (4 * 1024 * 1024)
+#define DMA_RING_ADDR           0x10800000
+#define DMA_RING_SIZE           8
+#define DMA_RING_JOBS           4
+#define DMA_RESULT_ADDR         0x10900000
 
 /*
  * Reads a 32 bit value out of a 32 bit memory mapped register
@@ -53,6 +111,41 @@ void writeReg(uintptr_t addr, uint32_t val){
     *tmp = val;
 }
 
+/*
+ * XOR a buffer into Xdata through the data window: stage up to a window
+ * of it at a time, then write its length to Burst end to have it folded
+ * in and the result checked against Matcher.
+ */
+void xorBurst(const uint64_t* data, size_t words){
+    volatile uint64_t* fifo =
+        (volatile uint64_t*)(XOR_TEST_ADDR + XOR_FIFO_OFFSET);
+    size_t n, i;
+
+    while(words){
+        n = words < XOR_FIFO_SIZE / sizeof(uint64_t) ?
+            words : XOR_FIFO_SIZE / sizeof(uint64_t);
+        for(i = 0; i < n; i++){
+            fifo[i] = data[i];
+        }
+        writeReg(XOR_TEST_ADDR + REG_BURST_END_OFFSET, n * sizeof(uint64_t));
+        data += n;
+        words -= n;
+    }
+}
+
+/*
+ * XOR a buffer of 32 bit words the way the device does.
+ */
+uint32_t xorWords(const uint32_t* data, size_t words){
+    uint32_t acc = 0;
+    size_t i;
+
+    for(i = 0; i < words; i++){
+        acc ^= data[i];
+    }
+    return acc;
+}
+
 /* UART definitions. */
 #define PSU_UART0_ADDR              0xFF000000
 #define PSU_UART0_IDR               0x000CU
@@ -131,7 +224,92 @@ void SetUpPsUart0(){
     writeReg(PSU_UART0_ADDR + PSU_UART0_BAUDDIV, XUARTPS_BAUDDIV_RESET_VAL);
 }
 
+void outHex(uint32_t val){
+    int i;
+
+    for(i = 28; i >= 0; i -= 4){
+        outByte("0123456789ABCDEF"[(val >> i) & 0xF]);
+    }
+}
+
+void outResult(char* name, int pass, uint32_t result){
+    outString(name);
+    outHex(result);
+    outString(pass ? "  PASS\n" : "  FAIL\n");
+}
+
+/*
+ * Offload XORs of a multi-megabyte buffer to the XOR-TEST DMA, first as
+ * one job from the registers and then as a ring of jobs, polling for the
+ * done interrupt.
+ */
+void testDma(void){
+    uint32_t* buf = (uint32_t*)DMA_BUF_ADDR;
+    volatile XorDesc* ring = (volatile XorDesc*)DMA_RING_ADDR;
+    volatile uint32_t* results = (volatile uint32_t*)DMA_RESULT_ADDR;
+    size_t words = DMA_BUF_SIZE / sizeof(uint32_t);
+    size_t chunk = words / DMA_RING_JOBS;
+    uint32_t expected[DMA_RING_JOBS];
+    uint32_t total = 0;
+    uint32_t result;
+    int pass;
+    size_t i;
+
+    for(i = 0; i < words; i++){
+        buf[i] = (uint32_t)(i * 0x9E3779B9U);
+    }
+    for(i = 0; i < DMA_RING_JOBS; i++){
+        expected[i] = xorWords(buf + i * chunk, chunk);
+        total ^= expected[i];
+    }
+
+    /* One job straight from the registers. */
+    writeReg(XOR_TEST_ADDR + REG_MATCHER_OFFSET, total);
+    writeReg(XOR_TEST_ADDR + REG_SRC_LO_OFFSET, DMA_BUF_ADDR);
+    writeReg(XOR_TEST_ADDR + REG_SRC_HI_OFFSET, 0);
+    writeReg(XOR_TEST_ADDR + REG_LEN_OFFSET, DMA_BUF_SIZE);
+    writeReg(XOR_TEST_ADDR + REG_DST_LO_OFFSET, DMA_RESULT_ADDR);
+    writeReg(XOR_TEST_ADDR + REG_DST_HI_OFFSET, 0);
+    writeReg(XOR_TEST_ADDR + REG_CTRL_OFFSET, CTRL_START | CTRL_IRQ_EN);
+    while(!(readReg(XOR_TEST_ADDR + REG_ISR_OFFSET) & ISR_DONE)){
+    }
+    writeReg(XOR_TEST_ADDR + REG_ISR_OFFSET, ISR_DONE);
+    result = readReg(XOR_TEST_ADDR + REG_RESULT_OFFSET);
+    pass = result == total && results[0] == total &&
+        readReg(XOR_TEST_ADDR + REG_STATUS_OFFSET) == STATUS_MATCH;
+    outResult(" DMA 4MB job: ", pass, result);
+
+    /* The same buffer as a batch of jobs on the ring, one interrupt. */
+    writeReg(XOR_TEST_ADDR + REG_RING_BASE_LO_OFFSET, DMA_RING_ADDR);
+    writeReg(XOR_TEST_ADDR + REG_RING_BASE_HI_OFFSET, 0);
+    writeReg(XOR_TEST_ADDR + REG_RING_SIZE_OFFSET, DMA_RING_SIZE);
+    for(i = 0; i < DMA_RING_JOBS; i++){
+        ring[i].src = DMA_BUF_ADDR + i * chunk * sizeof(uint32_t);
+        ring[i].len = chunk * sizeof(uint32_t);
+        ring[i].reserved = 0;
+        ring[i].dst = DMA_RESULT_ADDR + (i + 1) * sizeof(uint32_t);
+        ring[i].result = 0;
+        ring[i].status = 0;
+    }
+    writeReg(XOR_TEST_ADDR + REG_RING_HEAD_OFFSET, DMA_RING_JOBS);
+    while(!(readReg(XOR_TEST_ADDR + REG_ISR_OFFSET) & ISR_DONE)){
+    }
+    writeReg(XOR_TEST_ADDR + REG_ISR_OFFSET, ISR_DONE);
+    pass = readReg(XOR_TEST_ADDR + REG_RING_TAIL_OFFSET) == DMA_RING_JOBS;
+    result = 0;
+    for(i = 0; i < DMA_RING_JOBS; i++){
+        pass = pass && ring[i].result == expected[i] &&
+            results[i + 1] == expected[i] &&
+            (ring[i].status & (DESC_DONE | DESC_ERROR)) == DESC_DONE;
+        result ^= ring[i].result;
+    }
+    outResult(" DMA ring of 4 jobs: ", pass && result == total, result);
+}
+
 int main(int argc, char* argv[]){
+    static const uint64_t burst[] = {
+        0x0123456789ABCDEFULL, 0xFEDCBA9876543210ULL, 0x1234567800000000ULL,
+    };
 
     SetUpPsUart0();
     outString(" Hello World on Xilinx's QEMU for ZCU102\n");
@@ -141,5 +319,11 @@ int main(int argc, char* argv[]){
     writeReg(XOR_TEST_ADDR + REG_XDATA_OFFSET, 0xFF00030A);
     readReg(XOR_TEST_ADDR + REG_XDATA_OFFSET);
 
+    /* The burst XORs to 0x12345678, which with Xdata's 0x00FF020F matches. */
+    writeReg(XOR_TEST_ADDR + REG_MATCHER_OFFSET, 0x12CB5477);
+    xorBurst(burst, sizeof(burst) / sizeof(burst[0]));
+
+    testDma();
+
     return 0;
 }
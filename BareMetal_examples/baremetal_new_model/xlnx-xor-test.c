@@ -26,49 +26,159 @@
 #include "qemu/log.h"
 #include "qapi/error.h"
 #include "hw/irq.h"
+#include "qemu/units.h"
+#include "hw/qdev-properties.h"
+#include "exec/address-spaces.h"
+#include "sysemu/dma.h"
+#include "qemu/timer.h"
+#include "trace.h"
 
 #ifndef XOR_TEST_ERR_DEBUG
-#define XOR_TEST_ERR_DEBUG 1
+#define XOR_TEST_ERR_DEBUG 0
 #endif
 
 #define TYPE_XOR_TEST "xlnx.xor-test"
 #define XOR_TEST(obj) \
     OBJECT_CHECK(XorTestState, (obj), TYPE_XOR_TEST)
 
-#define DB_PRINT(...) do { \
-    if (XOR_TEST_ERR_DEBUG) { \
-        qemu_log(__VA_ARGS__); \
-    } \
-} while (0)
-
 REG32(XDATA, 0x0)
 REG32(MATCHER, 0x4)
+REG32(BURST_END, 0x8)
+REG32(CTRL, 0xc)
+    FIELD(CTRL, START, 0, 1)
+    FIELD(CTRL, IRQ_EN, 1, 1)
+REG32(STATUS, 0x10)
+    FIELD(STATUS, BUSY, 0, 1)
+    FIELD(STATUS, MATCH, 1, 1)
+    FIELD(STATUS, ERROR, 2, 1)
+REG32(ISR, 0x14)
+    FIELD(ISR, DONE, 0, 1)
+REG32(SRC_LO, 0x18)
+REG32(SRC_HI, 0x1c)
+REG32(LEN, 0x20)
+REG32(DST_LO, 0x24)
+REG32(DST_HI, 0x28)
+REG32(RESULT, 0x2c)
+REG32(RING_BASE_LO, 0x30)
+REG32(RING_BASE_HI, 0x34)
+REG32(RING_SIZE, 0x38)
+REG32(RING_HEAD, 0x3c)
+REG32(RING_TAIL, 0x40)
+
+#define R_MAX (R_RING_TAIL + 1)
+
+/*
+ * DMA. A job XORs LEN bytes (a multiple of 4) of guest memory at SRC
+ * together 32 bits at a time, stores the result in RESULT and, when DST
+ * isn't 0, writes it to guest memory there too. STATUS.MATCH says whether
+ * it equals MATCHER.
+ *
+ * Setting CTRL.START runs one job from the SRC, LEN and DST registers.
+ * Jobs can also be queued on a ring of RING_SIZE XorTestDesc in guest
+ * memory at RING_BASE: the guest fills descriptors from RING_HEAD on, then
+ * writes the new RING_HEAD, and every descriptor from RING_TAIL up to it
+ * is run, its result and status written back, and RING_TAIL moved on.
+ *
+ * ISR.DONE is set once per CTRL.START or RING_HEAD write, and raises the
+ * interrupt when CTRL.IRQ_EN is set, so a whole ring is one interrupt.
+ *
+ * Jobs complete at once unless the bytes-per-cycle or latency-cycles
+ * properties give a timing model, see xor_test_dma_issue. STATUS.BUSY is
+ * set until then, and RING_TAIL moves on as each descriptor completes;
+ * CTRL.START is ignored meanwhile and RING_HEAD writes are picked up once
+ * the work in progress completes.
+ */
+typedef struct XorTestDesc {
+    uint64_t src;
+    uint32_t len;
+    uint32_t reserved;
+    uint64_t dst;
+    /* written back by the device */
+    uint32_t result;
+    uint32_t status;
+} QEMU_PACKED XorTestDesc;
+
+#define XOR_TEST_DESC_DONE  (1 << 0)
+#define XOR_TEST_DESC_MATCH (1 << 1)
+#define XOR_TEST_DESC_ERROR (1 << 2)
+
+/* Most of a buffer to take at once when it can't be mapped directly */
+#define XOR_TEST_DMA_CHUNK  (64 * KiB)
+
+/*
+ * Data window. Plain RAM the guest stages a burst of 32 bit words in
+ * (e.g. with memcpy) without an MMIO exit per access. Writing the burst's
+ * length in bytes to BURST_END then XORs that much of the window, from
+ * its start, into XDATA and compares the result with MATCHER once.
+ * Longer buffers go through as several bursts.
+ */
+#define XOR_TEST_FIFO_ADDR  0x100
+#define XOR_TEST_FIFO_SIZE  0x100
+#define XOR_TEST_MMIO_SIZE  (XOR_TEST_FIFO_ADDR + XOR_TEST_FIFO_SIZE)
 
-#define R_MAX (R_MATCHER + 1)
 typedef struct XorTestState {
     SysBusDevice parent_obj;
 
     MemoryRegion iomem;
+    MemoryRegion fifo;
     qemu_irq irq;
 
+    MemoryRegion *dma_mr;
+    AddressSpace *dma_as;
+    AddressSpace dma_as_local;
+    uint8_t dma_buf[XOR_TEST_DMA_CHUNK];
+
+    /* XDATA has matched MATCHER since MATCHER was last written */
+    bool matched;
+    /* XDATA matches and matching DMA jobs, read only "match-count" */
+    uint64_t match_count;
+
+    /* Timing model, all in cycles of clock_hz */
+    uint32_t clock_hz;
+    uint32_t bytes_per_cycle;
+    uint32_t latency_cycles;
+    QEMUTimer *timer;
+    /*
+     * The job in flight, copied from the registers or read from the ring
+     * when it started, and the ring it came from
+     */
+    XorTestDesc job;
+    bool busy_ring;
+    dma_addr_t busy_base;
+    uint32_t busy_size;
+    uint32_t busy_head;
+    bool ring_pending;
+
     uint32_t regs[R_MAX];
     RegisterInfo regs_info[R_MAX];
 } XorTestState;
 
 static void xor_test_update_irq(XorTestState *s)
+{
+    bool pending = s->matched ||
+                   (ARRAY_FIELD_EX32(s->regs, ISR, DONE) &&
+                    ARRAY_FIELD_EX32(s->regs, CTRL, IRQ_EN));
+
+    trace_xor_test_irq(pending);
+    qemu_set_irq(s->irq, pending);
+}
+
+static void xor_test_check_match(XorTestState *s)
 {
     if (s->regs[R_XDATA] == s->regs[R_MATCHER]) {
-        qemu_log("XoRed data Matched. Raising the interrupt.\n");
-        qemu_irq_raise(s->irq);
+        s->matched = true;
+        s->match_count++;
+        trace_xor_test_match(s->regs[R_XDATA], s->match_count);
     }
+    xor_test_update_irq(s);
 }
 
 static void xor_test_matcher_post_write(RegisterInfo *reg, uint64_t val64)
 {
     XorTestState *s = XOR_TEST(reg->opaque);
 
-    qemu_irq_lower(s->irq);
-    xor_test_update_irq(s);
+    s->matched = false;
+    xor_test_check_match(s);
 }
 
 static uint64_t xor_test_xdata_pre_write(RegisterInfo *reg, uint64_t val64)
@@ -76,17 +186,335 @@ static uint64_t xor_test_xdata_pre_write(RegisterInfo *reg, uint64_t val64)
     XorTestState *s = XOR_TEST(reg->opaque);
 
     s->regs[R_XDATA] = s->regs[R_XDATA] ^ val64;
-    xor_test_update_irq(s);
+    xor_test_check_match(s);
 
     return s->regs[R_XDATA];
 }
 
+/* XOR a buffer of 32 bit words, 64 bits at a time, into acc */
+static uint64_t xor_test_fold(uint64_t acc, const uint8_t *p, uint64_t len)
+{
+    for (; len >= 8; p += 8, len -= 8) {
+        acc ^= ldq_le_p(p);
+    }
+    if (len >= 4) {
+        acc ^= ldl_le_p(p);
+    }
+    return acc;
+}
+
+static void xor_test_burst_end_post_write(RegisterInfo *reg, uint64_t val64)
+{
+    XorTestState *s = XOR_TEST(reg->opaque);
+    uint32_t len = val64;
+    uint64_t acc;
+
+    if (len > XOR_TEST_FIFO_SIZE) {
+        qemu_log_mask(LOG_GUEST_ERROR,
+                      "%s: BURST_END %u past the end of the window\n",
+                      TYPE_XOR_TEST, len);
+        len = XOR_TEST_FIFO_SIZE;
+    }
+    acc = xor_test_fold(0, memory_region_get_ram_ptr(&s->fifo), len);
+    trace_xor_test_burst(len, acc);
+    s->regs[R_XDATA] ^= (uint32_t)acc ^ (uint32_t)(acc >> 32);
+    xor_test_check_match(s);
+}
+
+/*
+ * Run one job, returning its XOR_TEST_DESC_* status. Guest RAM is XORed
+ * in place through address_space_map, anything else a chunk at a time
+ * through dma_buf.
+ */
+static uint32_t xor_test_dma_run(XorTestState *s, dma_addr_t src,
+                                 uint64_t len, dma_addr_t dst,
+                                 uint32_t *result)
+{
+    uint64_t acc = 0;
+    uint32_t le_result;
+    hwaddr plen;
+    void *p;
+
+    *result = 0;
+    if (len % 4) {
+        return XOR_TEST_DESC_DONE | XOR_TEST_DESC_ERROR;
+    }
+
+    while (len) {
+        plen = len;
+        p = address_space_map(s->dma_as, src, &plen, false,
+                              MEMTXATTRS_UNSPECIFIED);
+        if (p && plen % 4 == 0) {
+            acc = xor_test_fold(acc, p, plen);
+            address_space_unmap(s->dma_as, p, plen, false, plen);
+        } else {
+            if (p) {
+                address_space_unmap(s->dma_as, p, plen, false, 0);
+            }
+            plen = MIN(len, sizeof(s->dma_buf));
+            if (dma_memory_read(s->dma_as, src, s->dma_buf, plen)) {
+                return XOR_TEST_DESC_DONE | XOR_TEST_DESC_ERROR;
+            }
+            acc = xor_test_fold(acc, s->dma_buf, plen);
+        }
+        src += plen;
+        len -= plen;
+    }
+
+    *result = (uint32_t)acc ^ (uint32_t)(acc >> 32);
+    if (dst) {
+        le_result = cpu_to_le32(*result);
+        if (dma_memory_write(s->dma_as, dst, &le_result,
+                             sizeof(le_result))) {
+            return XOR_TEST_DESC_DONE | XOR_TEST_DESC_ERROR;
+        }
+    }
+    if (*result == s->regs[R_MATCHER]) {
+        s->match_count++;
+        return XOR_TEST_DESC_DONE | XOR_TEST_DESC_MATCH;
+    }
+    return XOR_TEST_DESC_DONE;
+}
+
+static void xor_test_dma_status(XorTestState *s, uint32_t status,
+                                uint32_t result)
+{
+    s->regs[R_RESULT] = result;
+    ARRAY_FIELD_DP32(s->regs, STATUS, MATCH,
+                     !!(status & XOR_TEST_DESC_MATCH));
+    ARRAY_FIELD_DP32(s->regs, STATUS, ERROR,
+                     !!(status & XOR_TEST_DESC_ERROR));
+}
+
+static void xor_test_dma_done(XorTestState *s)
+{
+    trace_xor_test_dma_done(s->regs[R_STATUS], s->regs[R_RESULT],
+                            s->regs[R_RING_TAIL]);
+    ARRAY_FIELD_DP32(s->regs, ISR, DONE, 1);
+    xor_test_update_irq(s);
+}
+
+static bool xor_test_ring_valid(XorTestState *s, uint32_t head)
+{
+    uint32_t size = s->regs[R_RING_SIZE];
+
+    if (head >= size || s->regs[R_RING_TAIL] >= size) {
+        qemu_log_mask(LOG_GUEST_ERROR,
+                      "%s: RING_HEAD %u outside a ring of %u\n",
+                      TYPE_XOR_TEST, head, size);
+        return false;
+    }
+    return true;
+}
+
+/* Read the ring's descriptor at RING_TAIL into the job in flight */
+static bool xor_test_ring_fetch(XorTestState *s)
+{
+    dma_addr_t addr = s->busy_base +
+                      (dma_addr_t)s->regs[R_RING_TAIL] * sizeof(XorTestDesc);
+
+    return !dma_memory_read(s->dma_as, addr, &s->job, sizeof(s->job));
+}
+
+/*
+ * Run the job in flight and, on a ring, write its result back and move
+ * RING_TAIL on. Returns whether the ring's next descriptor is now in
+ * flight; otherwise the work is complete and ISR.DONE has been set.
+ */
+static bool xor_test_dma_step(XorTestState *s)
+{
+    uint64_t src = le64_to_cpu(s->job.src);
+    uint32_t len = le32_to_cpu(s->job.len);
+    uint64_t dst = le64_to_cpu(s->job.dst);
+    uint32_t tail = s->regs[R_RING_TAIL];
+    uint32_t result;
+    uint32_t status;
+    dma_addr_t addr;
+
+    status = xor_test_dma_run(s, src, len, dst, &result);
+    trace_xor_test_dma_job(src, len, dst, result, status);
+
+    if (s->busy_ring) {
+        addr = s->busy_base + (dma_addr_t)tail * sizeof(XorTestDesc);
+        s->job.result = cpu_to_le32(result);
+        s->job.status = cpu_to_le32(status);
+        if (dma_memory_write(s->dma_as, addr + offsetof(XorTestDesc, result),
+                             &s->job.result,
+                             sizeof(s->job.result) + sizeof(s->job.status))) {
+            status = XOR_TEST_DESC_ERROR;
+        } else {
+            s->regs[R_RING_TAIL] = (tail + 1) % s->busy_size;
+            if (s->regs[R_RING_TAIL] != s->busy_head) {
+                if (xor_test_ring_fetch(s)) {
+                    return true;
+                }
+                status = XOR_TEST_DESC_ERROR;
+            }
+        }
+    }
+    xor_test_dma_status(s, status, result);
+    xor_test_dma_done(s);
+    return false;
+}
+
+/*
+ * Run the job in flight, and on a ring every descriptor after it. Without
+ * a timing model they run there and then, otherwise STATUS.BUSY is set
+ * and each runs when its modelled time is up on the virtual clock:
+ * latency-cycles plus a cycle for every bytes-per-cycle bytes, at
+ * clock-frequency.
+ */
+static void xor_test_dma_issue(XorTestState *s)
+{
+    uint64_t bytes;
+    uint64_t cycles;
+    uint64_t delay;
+
+    if (!s->bytes_per_cycle && !s->latency_cycles) {
+        do {
+            trace_xor_test_dma_start(s->busy_ring,
+                                     le32_to_cpu(s->job.len), 0);
+        } while (xor_test_dma_step(s));
+        return;
+    }
+
+    bytes = le32_to_cpu(s->job.len);
+    cycles = s->latency_cycles;
+    if (s->bytes_per_cycle) {
+        cycles += DIV_ROUND_UP(bytes, s->bytes_per_cycle);
+    }
+
+    delay = muldiv64(cycles, NANOSECONDS_PER_SECOND, s->clock_hz);
+    trace_xor_test_dma_start(s->busy_ring, bytes, delay);
+
+    ARRAY_FIELD_DP32(s->regs, STATUS, BUSY, 1);
+    timer_mod(s->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + delay);
+}
+
+/*
+ * Start a job from the SRC, LEN and DST registers, or the ring up to
+ * RING_HEAD. Those registers, and the ring's, are copied here, so a guest
+ * setting up the next job while STATUS.BUSY doesn't change this one.
+ */
+static void xor_test_dma_start(XorTestState *s, bool ring)
+{
+    uint32_t head = s->regs[R_RING_HEAD];
+
+    s->busy_ring = ring;
+    if (!ring) {
+        s->job.src = cpu_to_le64(deposit64(s->regs[R_SRC_LO], 32, 32,
+                                           s->regs[R_SRC_HI]));
+        s->job.len = cpu_to_le32(s->regs[R_LEN]);
+        s->job.dst = cpu_to_le64(deposit64(s->regs[R_DST_LO], 32, 32,
+                                           s->regs[R_DST_HI]));
+        xor_test_dma_issue(s);
+        return;
+    }
+
+    if (!xor_test_ring_valid(s, head)) {
+        xor_test_dma_status(s, XOR_TEST_DESC_ERROR, 0);
+        xor_test_dma_done(s);
+        return;
+    }
+    if (s->regs[R_RING_TAIL] == head) {
+        xor_test_dma_status(s, XOR_TEST_DESC_DONE, 0);
+        xor_test_dma_done(s);
+        return;
+    }
+
+    s->busy_base = deposit64(s->regs[R_RING_BASE_LO], 32, 32,
+                             s->regs[R_RING_BASE_HI]);
+    s->busy_size = s->regs[R_RING_SIZE];
+    s->busy_head = head;
+    if (!xor_test_ring_fetch(s)) {
+        xor_test_dma_status(s, XOR_TEST_DESC_ERROR, 0);
+        xor_test_dma_done(s);
+        return;
+    }
+    xor_test_dma_issue(s);
+}
+
+static void xor_test_dma_timer(void *opaque)
+{
+    XorTestState *s = XOR_TEST(opaque);
+
+    ARRAY_FIELD_DP32(s->regs, STATUS, BUSY, 0);
+    if (xor_test_dma_step(s)) {
+        xor_test_dma_issue(s);
+        return;
+    }
+
+    /* RING_HEAD moved on while busy */
+    if (s->ring_pending) {
+        s->ring_pending = false;
+        xor_test_dma_start(s, true);
+    }
+}
+
+static void xor_test_ctrl_post_write(RegisterInfo *reg, uint64_t val64)
+{
+    XorTestState *s = XOR_TEST(reg->opaque);
+
+    if (ARRAY_FIELD_EX32(s->regs, CTRL, START)) {
+        ARRAY_FIELD_DP32(s->regs, CTRL, START, 0);
+        if (ARRAY_FIELD_EX32(s->regs, STATUS, BUSY)) {
+            qemu_log_mask(LOG_GUEST_ERROR, "%s: CTRL.START while busy\n",
+                          TYPE_XOR_TEST);
+        } else {
+            xor_test_dma_start(s, false);
+        }
+    }
+    xor_test_update_irq(s);
+}
+
+static void xor_test_ring_head_post_write(RegisterInfo *reg, uint64_t val64)
+{
+    XorTestState *s = XOR_TEST(reg->opaque);
+
+    if (ARRAY_FIELD_EX32(s->regs, STATUS, BUSY)) {
+        s->ring_pending = true;
+        return;
+    }
+    xor_test_dma_start(s, true);
+}
+
+static void xor_test_isr_post_write(RegisterInfo *reg, uint64_t val64)
+{
+    XorTestState *s = XOR_TEST(reg->opaque);
+
+    xor_test_update_irq(s);
+}
+
 static RegisterAccessInfo xor_test_regs_info[] = {
     {   .name = "XDATA", .addr = A_XDATA,
         .pre_write = xor_test_xdata_pre_write,
     },{ .name = "MATCHER", .addr = A_MATCHER,
         .reset = 0xffffffff,
         .post_write = xor_test_matcher_post_write,
+    },{ .name = "BURST_END", .addr = A_BURST_END,
+        .post_write = xor_test_burst_end_post_write,
+    },{ .name = "CTRL", .addr = A_CTRL,
+        .rsvd = ~(R_CTRL_START_MASK | R_CTRL_IRQ_EN_MASK),
+        .post_write = xor_test_ctrl_post_write,
+    },{ .name = "STATUS", .addr = A_STATUS,
+        .ro = 0xffffffff,
+    },{ .name = "ISR", .addr = A_ISR,
+        .w1c = R_ISR_DONE_MASK,
+        .post_write = xor_test_isr_post_write,
+    },{ .name = "SRC_LO", .addr = A_SRC_LO,
+    },{ .name = "SRC_HI", .addr = A_SRC_HI,
+    },{ .name = "LEN", .addr = A_LEN,
+    },{ .name = "DST_LO", .addr = A_DST_LO,
+    },{ .name = "DST_HI", .addr = A_DST_HI,
+    },{ .name = "RESULT", .addr = A_RESULT,
+        .ro = 0xffffffff,
+    },{ .name = "RING_BASE_LO", .addr = A_RING_BASE_LO,
+    },{ .name = "RING_BASE_HI", .addr = A_RING_BASE_HI,
+    },{ .name = "RING_SIZE", .addr = A_RING_SIZE,
+    },{ .name = "RING_HEAD", .addr = A_RING_HEAD,
+        .post_write = xor_test_ring_head_post_write,
+    },{ .name = "RING_TAIL", .addr = A_RING_TAIL,
+        .ro = 0xffffffff,
     },
 };
 
@@ -98,6 +526,9 @@ static void xor_test_reset(DeviceState *dev)
     for (i = 0; i < ARRAY_SIZE(s->regs_info); ++i) {
         register_reset(&s->regs_info[i]);
     }
+    s->matched = false;
+    timer_del(s->timer);
+    s->ring_pending = false;
     qemu_irq_lower(s->irq);
 }
 
@@ -119,7 +550,7 @@ static void xor_test_init(Object *obj)
     RegisterInfoArray *reg_array;
 
     memory_region_init(&s->iomem, obj, TYPE_XOR_TEST,
-                        R_MAX * 4);
+                        XOR_TEST_MMIO_SIZE);
     reg_array = register_init_block32(DEVICE(obj), xor_test_regs_info,
                                ARRAY_SIZE(xor_test_regs_info),
                                s->regs_info, s->regs,
@@ -130,13 +561,54 @@ static void xor_test_init(Object *obj)
     memory_region_add_subregion(&s->iomem, 0x00, &reg_array->mem);
     sysbus_init_mmio(sbd, &s->iomem);
     sysbus_init_irq(SYS_BUS_DEVICE(obj), &s->irq);
+
+    object_property_add_uint64_ptr(obj, "match-count", &s->match_count,
+                                   OBJ_PROP_FLAG_READ);
+}
+
+static void xor_test_realize(DeviceState *dev, Error **errp)
+{
+    XorTestState *s = XOR_TEST(dev);
+    Error *local_err = NULL;
+
+    if (!s->clock_hz) {
+        error_setg(errp, "%s: clock-frequency must be set", TYPE_XOR_TEST);
+        return;
+    }
+    memory_region_init_ram(&s->fifo, OBJECT(dev), TYPE_XOR_TEST "-fifo",
+                           XOR_TEST_FIFO_SIZE, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return;
+    }
+    memory_region_add_subregion(&s->iomem, XOR_TEST_FIFO_ADDR, &s->fifo);
+    s->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, xor_test_dma_timer, s);
+
+    if (s->dma_mr) {
+        address_space_init(&s->dma_as_local, s->dma_mr, TYPE_XOR_TEST "-dma");
+        s->dma_as = &s->dma_as_local;
+    } else {
+        s->dma_as = &address_space_memory;
+    }
 }
 
+static Property xor_test_properties[] = {
+    DEFINE_PROP_LINK("dma", XorTestState, dma_mr,
+                     TYPE_MEMORY_REGION, MemoryRegion *),
+    DEFINE_PROP_UINT32("clock-frequency", XorTestState, clock_hz,
+                       100 * 1000 * 1000),
+    DEFINE_PROP_UINT32("bytes-per-cycle", XorTestState, bytes_per_cycle, 0),
+    DEFINE_PROP_UINT32("latency-cycles", XorTestState, latency_cycles, 0),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
 static void xor_test_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
 
     dc->reset = xor_test_reset;
+    dc->realize = xor_test_realize;
+    device_class_set_props(dc, xor_test_properties);
 }
 
 static const TypeInfo xor_test_info = {
@@ -31,87 +31,558 @@
 #include <stdbool.h>
 
 #define UART0_BASE              0xFF000000
+#define UART1_BASE              0xFF010000
+#define GPIO_BASE               0xFF0A0000
+#define TTC0_BASE               0xFF110000
 
+#define UART_OFFSET_IER         0x0008
+#define UART_OFFSET_IDR         0x000C
+#define UART_OFFSET_ISR         0x0014
+#define UART_OFFSET_RXWM        0x0020
 #define UART_OFFSET_SR          0x002C
 #define UART_OFFSET_FIFO        0x0030
 
+#define UART_MASK_SR_RTRIG      0x00000001
+#define UART_MASK_SR_RXEMPTY    0x00000002
+#define UART_MASK_SR_TXEMPTY    0x00000008
 #define UART_MASK_SR_TXFULL     0x00000010
 
+/* The interrupt registers share the status bit layout for these */
+#define UART_MASK_IXR_RTRIG     0x00000001
+#define UART_MASK_IXR_TXEMPTY   0x00000008
+
+/* Depth of the Cadence UART TX FIFO */
+#define UART_TX_FIFO_DEPTH      64
+
+/* RX FIFO level to be woken at, half the FIFO */
+#define UART_RX_TRIGGER         32
+
+#define DEFAULT_TX_SIZE         16
+
 #define MENU_STR \
     "\n***************UART TX MENU***************\n" \
     "g: Generate new data to transmit\n" \
     "t: Transmit the UART data\n" \
+    "r: Receive as much UART data\n" \
+    "d: Dump the first registers of every peripheral\n" \
     "<RETURN>: Exit\n"
 
+static bool verbose;
+
+/* The UIO device the UART is bound to, -1 when mapped through /dev/mem */
+static int uio_fd = -1;
+
+#ifdef REG_TRACE
+static void reg_trace(const uint32_t *reg, bool write,
+                      const struct timespec *start);
+#endif
+
 static inline uint32_t REG_R32(const uint32_t *reg)
 {
+#ifdef REG_TRACE
+    struct timespec start;
+    uint32_t val;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    val = *(volatile uint32_t *)reg;
+    reg_trace(reg, false, &start);
+    return val;
+#else
     return *(volatile uint32_t *)reg;
+#endif
 }
 
 static inline void REG_W32(uint32_t *reg, uint32_t val)
 {
     volatile uint32_t *p;
+#ifdef REG_TRACE
+    struct timespec start;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+#endif
     p = (volatile uint32_t *)reg;
     *p = val;
+#ifdef REG_TRACE
+    reg_trace(reg, true, &start);
+#endif
 }
 
-static void uart_tx_byte(uint32_t *uart, char byte)
+enum periph_id {
+    PERIPH_UART0,
+    PERIPH_UART1,
+    PERIPH_GPIO,
+    PERIPH_TTC0,
+    PERIPH_MAX,
+};
+
+/*
+ * A peripheral's register window, mapped the first time it is asked for
+ * and kept until periph_unmap_all(). The mapping covers the whole window
+ * rounded out to pages, so windows that are not page sized or aligned work.
+ */
+struct periph {
+    const char *name;
+    size_t base;
+    size_t size;
+    void *map;
+    size_t map_len;
+    uint8_t *regs;
+};
+
+static struct periph periphs[PERIPH_MAX] = {
+    [PERIPH_UART0] = { "uart0", UART0_BASE, 0x1000 },
+    [PERIPH_UART1] = { "uart1", UART1_BASE, 0x1000 },
+    [PERIPH_GPIO] = { "gpio", GPIO_BASE, 0x1000 },
+    [PERIPH_TTC0] = { "ttc0", TTC0_BASE, 0x1000 },
+};
+
+/* /dev/mem, opened for the first mapping and kept for the rest */
+static int mem_fd = -1;
+
+#ifdef REG_TRACE
+/*
+ * Build with -DREG_TRACE to count every REG_R32/REG_W32 per register and
+ * direction, with a histogram of how long each took by clock_gettime.
+ * Bucket n holds accesses taking less than 2^(n+1) ns, and the last one
+ * everything from 2^31 ns up. The table goes out as CSV on exit, to the
+ * file named by $REG_TRACE_CSV or else stderr.
+ */
+#define REG_TRACE_SLOTS         256
+#define REG_TRACE_BUCKETS       32
+
+struct reg_trace_entry {
+    const uint32_t *reg;
+    bool write;
+    const char *periph;
+    size_t offset;
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t min_ns;
+    uint64_t max_ns;
+    uint64_t hist[REG_TRACE_BUCKETS];
+};
+
+static struct reg_trace_entry reg_traces[REG_TRACE_SLOTS];
+static uint64_t reg_trace_dropped;
+
+static void reg_trace_dump(void)
 {
-    // Spin until TX isn't full
-    while (REG_R32((const uint32_t *)(uart + UART_OFFSET_SR)) &
-           UART_MASK_SR_TXFULL);
-            
-    printf("TX->%.2x\n", byte);
-    REG_W32((uint32_t *)(uart + UART_OFFSET_FIFO), byte);
+    const char *path = getenv("REG_TRACE_CSV");
+    FILE *out = path ? fopen(path, "w") : stderr;
+    struct reg_trace_entry *e;
+    int i, b;
+
+    if (!out) {
+        printf("open %s failed: %s\n", path, strerror(errno));
+        return;
+    }
+
+    fprintf(out, "periph,offset,access,count,total_ns,min_ns,max_ns");
+    for (b = 0; b < REG_TRACE_BUCKETS - 1; ++b) {
+        fprintf(out, ",lt_%lluns", 2ULL << b);
+    }
+    fprintf(out, ",ge_%lluns", 1ULL << b);
+    fputs("\n", out);
+
+    for (i = 0; i < REG_TRACE_SLOTS; ++i) {
+        e = &reg_traces[i];
+        if (!e->count) {
+            continue;
+        }
+        fprintf(out, "%s,0x%04zx,%s,%llu,%llu,%llu,%llu",
+                e->periph, e->offset, e->write ? "write" : "read",
+                (unsigned long long)e->count,
+                (unsigned long long)e->total_ns,
+                (unsigned long long)e->min_ns,
+                (unsigned long long)e->max_ns);
+        for (b = 0; b < REG_TRACE_BUCKETS; ++b) {
+            fprintf(out, ",%llu", (unsigned long long)e->hist[b]);
+        }
+        fputs("\n", out);
+    }
+    if (reg_trace_dropped) {
+        fprintf(stderr, "reg trace: %llu accesses not recorded, "
+                "more than %d registers\n",
+                (unsigned long long)reg_trace_dropped, REG_TRACE_SLOTS);
+    }
+
+    if (out != stderr) {
+        fclose(out);
+    }
 }
 
-static void uart_tx(uint32_t *uart, const char *data, size_t size)
+/* Name the register on its first access, as the mapping may be gone at exit */
+static void reg_trace_name(struct reg_trace_entry *e)
 {
-    size_t i;
+    const uint8_t *reg = (const uint8_t *)e->reg;
+    int i;
+
+    e->periph = "unknown";
+    e->offset = (size_t)reg;
+    for (i = 0; i < PERIPH_MAX; ++i) {
+        if (periphs[i].regs && reg >= periphs[i].regs &&
+            reg < periphs[i].regs + periphs[i].size) {
+            e->periph = periphs[i].name;
+            e->offset = reg - periphs[i].regs;
+            break;
+        }
+    }
+}
 
-    for (i=0; i<size; ++i) {
-        uart_tx_byte(uart, data[i]);
+static void reg_trace(const uint32_t *reg, bool write,
+                      const struct timespec *start)
+{
+    static bool registered;
+    struct reg_trace_entry *e;
+    struct timespec end;
+    uint64_t ns;
+    size_t slot;
+    size_t n;
+    int b;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    ns = (end.tv_sec - start->tv_sec) * 1000000000ULL +
+         end.tv_nsec - start->tv_nsec;
+
+    // Open addressing on the register address, linear probing
+    slot = (((uintptr_t)reg >> 2) * 2 + write) % REG_TRACE_SLOTS;
+    for (n = 0; n < REG_TRACE_SLOTS; ++n) {
+        e = &reg_traces[(slot + n) % REG_TRACE_SLOTS];
+        if (!e->count) {
+            e->reg = reg;
+            e->write = write;
+            e->min_ns = UINT64_MAX;
+            reg_trace_name(e);
+            break;
+        }
+        if (e->reg == reg && e->write == write) {
+            break;
+        }
+    }
+    if (n == REG_TRACE_SLOTS) {
+        reg_trace_dropped++;
+        return;
+    }
+
+    if (!registered) {
+        atexit(reg_trace_dump);
+        registered = true;
+    }
+
+    for (b = 0; b < REG_TRACE_BUCKETS - 1 && ns >= (2ULL << b); ++b);
+    e->hist[b]++;
+    e->count++;
+    e->total_ns += ns;
+    if (ns < e->min_ns) {
+        e->min_ns = ns;
+    }
+    if (ns > e->max_ns) {
+        e->max_ns = ns;
     }
 }
+#endif
+
+/*
+ * The register at a byte offset into the peripheral. Callers that access
+ * a register often look it up once, as this checks the offset is a
+ * register within the window and aborts if not.
+ */
+static uint32_t *periph_reg(const struct periph *p, size_t offset)
+{
+    if (offset > p->size - sizeof(uint32_t) || offset % sizeof(uint32_t)) {
+        fprintf(stderr, "%s: bad register offset 0x%zx\n",
+                p->name, offset);
+        abort();
+    }
+    return (uint32_t *)(p->regs + offset);
+}
+
+static inline uint32_t periph_r32(const struct periph *p, size_t offset)
+{
+    return REG_R32(periph_reg(p, offset));
+}
+
+static inline void periph_w32(const struct periph *p, size_t offset,
+                              uint32_t val)
+{
+    REG_W32(periph_reg(p, offset), val);
+}
 
-static void *map_peripheral(size_t base_addr)
+static struct periph *periph_get(enum periph_id id)
 {
+    struct periph *p = &periphs[id];
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t start = p->base & ~(page - 1);
     void *addr;
-    int fd;
 
-    fd = open("/dev/mem", O_RDWR);
-    addr = mmap(NULL, 0x1000, PROT_READ | PROT_WRITE,
-                MAP_SHARED, fd, base_addr);
-    close(fd);
+    if (p->regs) {
+        return p;
+    }
+
+    if (mem_fd < 0) {
+        mem_fd = open("/dev/mem", O_RDWR | O_SYNC);
+        if (mem_fd < 0) {
+            printf("open /dev/mem failed: %s\n", strerror(errno));
+            return NULL;
+        }
+    }
 
+    p->map_len = (p->base + p->size - start + page - 1) & ~(page - 1);
+    addr = mmap(NULL, p->map_len, PROT_READ | PROT_WRITE,
+                MAP_SHARED, mem_fd, start);
+    if (addr == MAP_FAILED) {
+        printf("mmap %s failed: %s\n", p->name, strerror(errno));
+        return NULL;
+    }
+    p->map = addr;
+    p->regs = (uint8_t *)addr + (p->base - start);
+
+    return p;
+}
+
+static void periph_unmap_all(void)
+{
+    int i;
+
+    for (i = 0; i < PERIPH_MAX; ++i) {
+        if (periphs[i].map) {
+            munmap(periphs[i].map, periphs[i].map_len);
+            periphs[i].map = NULL;
+            periphs[i].regs = NULL;
+        }
+    }
+    if (mem_fd >= 0) {
+        close(mem_fd);
+        mem_fd = -1;
+    }
+}
+
+/*
+ * Sleep until the UART raises irq, with a UIO device. The interrupt is
+ * only enabled for the wait, so a level that stays up (an empty TX FIFO)
+ * doesn't keep firing, and the status register is checked once it is
+ * enabled so an event that has just happened isn't waited for.
+ */
+static void uart_wait_irq(const struct periph *uart, uint32_t irq,
+                          uint32_t sr_mask)
+{
+    uint32_t unmask = 1;
+    uint32_t count;
+
+    periph_w32(uart, UART_OFFSET_ISR, irq);
+    periph_w32(uart, UART_OFFSET_IER, irq);
+    if (!(periph_r32(uart, UART_OFFSET_SR) & sr_mask)) {
+        // uio_pdrv_genirq masks the line after each interrupt
+        if (write(uio_fd, &unmask, sizeof(unmask)) != sizeof(unmask) ||
+            read(uio_fd, &count, sizeof(count)) != sizeof(count)) {
+            printf("uio wait failed: %s\n", strerror(errno));
+        }
+    }
+    periph_w32(uart, UART_OFFSET_IDR, irq);
+    periph_w32(uart, UART_OFFSET_ISR, irq);
+}
+
+/*
+ * Push the data into the TX FIFO, reading the status register as little as
+ * possible as every access is a round trip to the (emulated) device. An
+ * empty FIFO takes a whole UART_TX_FIFO_DEPTH burst without looking again,
+ * otherwise one byte goes in for each time it is seen not to be full.
+ * Through UIO a FIFO that isn't empty is waited on with the TXEMPTY
+ * interrupt instead. Returns the number of status register reads.
+ */
+static size_t uart_tx(const struct periph *uart, const char *data, size_t size)
+{
+    uint32_t *sr = periph_reg(uart, UART_OFFSET_SR);
+    uint32_t *fifo = periph_reg(uart, UART_OFFSET_FIFO);
+    size_t reads = 0;
+    size_t burst;
+    size_t i = 0;
+    uint32_t status;
+
+    while (i < size) {
+        status = REG_R32(sr);
+        reads++;
+        if (status & UART_MASK_SR_TXEMPTY) {
+            burst = size - i < UART_TX_FIFO_DEPTH ?
+                    size - i : UART_TX_FIFO_DEPTH;
+        } else if (uio_fd >= 0) {
+            // Sleep until it has drained rather than spin
+            uart_wait_irq(uart, UART_MASK_IXR_TXEMPTY, UART_MASK_SR_TXEMPTY);
+            continue;
+        } else if (!(status & UART_MASK_SR_TXFULL)) {
+            burst = 1;
+        } else {
+            // Spin until TX isn't full
+            continue;
+        }
+
+        for (; burst; --burst, ++i) {
+            if (verbose) {
+                printf("TX->%.2x\n", (uint8_t)data[i]);
+            }
+            REG_W32(fifo, (uint8_t)data[i]);
+        }
+    }
+
+    return reads;
+}
+
+/*
+ * Fill data from the RX FIFO. The RX trigger is set to what is still
+ * wanted, up to UART_RX_TRIGGER, so once RTRIG is seen that many bytes are
+ * read without looking at the status again. Through UIO an empty FIFO is
+ * waited on with the RTRIG interrupt, otherwise the status is polled.
+ * Returns the number of status register reads.
+ */
+static size_t uart_rx(const struct periph *uart, char *data, size_t size)
+{
+    uint32_t *sr = periph_reg(uart, UART_OFFSET_SR);
+    uint32_t *fifo = periph_reg(uart, UART_OFFSET_FIFO);
+    size_t reads = 0;
+    size_t trigger = 0;
+    size_t wanted;
+    size_t burst;
+    size_t i = 0;
+    uint32_t status;
+
+    while (i < size) {
+        wanted = size - i < UART_RX_TRIGGER ? size - i : UART_RX_TRIGGER;
+        if (wanted != trigger) {
+            trigger = wanted;
+            periph_w32(uart, UART_OFFSET_RXWM, trigger);
+        }
+
+        status = REG_R32(sr);
+        reads++;
+        if (status & UART_MASK_SR_RTRIG) {
+            burst = trigger;
+        } else if (!(status & UART_MASK_SR_RXEMPTY)) {
+            burst = 1;
+        } else {
+            if (uio_fd >= 0) {
+                uart_wait_irq(uart, UART_MASK_IXR_RTRIG, UART_MASK_SR_RTRIG);
+            }
+            continue;
+        }
+
+        for (; burst; --burst, ++i) {
+            data[i] = REG_R32(fifo);
+            if (verbose) {
+                printf("RX<-%.2x\n", (uint8_t)data[i]);
+            }
+        }
+    }
+
+    return reads;
+}
+
+static double elapsed(const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) +
+           (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/*
+ * Map a peripheral through a UIO device instead, e.g. /dev/uio0 for a
+ * uio_pdrv_genirq node covering it, whose first map is the register space.
+ * The mapping is cached like one of /dev/mem.
+ */
+static struct periph *periph_get_uio(enum periph_id id, const char *dev)
+{
+    struct periph *p = &periphs[id];
+    void *addr;
+
+    uio_fd = open(dev, O_RDWR);
+    if (uio_fd < 0) {
+        printf("open %s failed: %s\n", dev, strerror(errno));
+        return NULL;
+    }
+
+    addr = mmap(NULL, p->size, PROT_READ | PROT_WRITE, MAP_SHARED, uio_fd, 0);
     if (addr == MAP_FAILED) {
         printf("mmap failed: %s\n", strerror(errno));
-        addr = NULL;
+        close(uio_fd);
+        uio_fd = -1;
+        return NULL;
     }
+    p->map = addr;
+    p->map_len = p->size;
+    p->regs = addr;
 
-    return addr;
+    return p;
 }
 
-static void prog_loop(void *uart)
+static void periph_dump(void)
+{
+    struct periph *p;
+    size_t off;
+    int i;
+
+    for (i = 0; i < PERIPH_MAX; ++i) {
+        p = periph_get(i);
+        if (!p) {
+            continue;
+        }
+        printf("%-6s %#zx:", p->name, p->base);
+        for (off = 0; off < 0x20; off += sizeof(uint32_t)) {
+            printf(" %.8x", periph_r32(p, off));
+        }
+        puts("");
+    }
+}
+
+static void prog_loop(const struct periph *uart, char *buf, size_t size)
 {
     size_t i;
-    char buf[16];
+    size_t reads;
+    size_t total = 0;
+    double secs;
+    double total_secs = 0;
+    struct timespec start;
     char cmd[16];
-    bool done;
+    bool done = false;
     
     while (!done) {
-        fgets(cmd, sizeof(cmd), stdin);
+        if (!fgets(cmd, sizeof(cmd), stdin)) {
+            break;
+        }
 
         switch(cmd[0]) {
             case 'g':
-                printf("Gen:");
-                for (i=0; i<sizeof(buf); ++i) {
+                printf("Gen: %zu bytes", size);
+                for (i=0; verbose && i<size; ++i) {
+                    buf[i] = rand() & 0xFF;
+                    printf(" %.2x", (uint8_t)buf[i]);
+                }
+                for (; i<size; ++i) {
                     buf[i] = rand() & 0xFF;
-                    printf(" %.2x", buf[i]);
                 }
                 puts("");
+                // Fall through - send what was just generated
             case 't':
-                uart_tx(uart, buf, sizeof(buf));
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                reads = uart_tx(uart, buf, size);
+                secs = elapsed(&start);
+                total += size;
+                total_secs += secs;
+                printf("TX %zu bytes in %.6f s, %.0f bytes/s, "
+                       "%zu status reads (total %zu bytes, %.0f bytes/s)\n",
+                       size, secs, secs > 0 ? size / secs : 0, reads,
+                       total, total_secs > 0 ? total / total_secs : 0);
+                break;
+            case 'r':
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                reads = uart_rx(uart, buf, size);
+                secs = elapsed(&start);
+                printf("RX %zu bytes in %.6f s, %.0f bytes/s, "
+                       "%zu status reads\n",
+                       size, secs, secs > 0 ? size / secs : 0, reads);
+                break;
+            case 'd':
+                periph_dump();
                 break;
             case '\n':
                 done = true;
@@ -123,19 +594,60 @@ static void prog_loop(void *uart)
     }
 }
 
-int main(void)
+int main(int argc, char *argv[])
 {
-    void *addr;
+    struct periph *uart;
+    enum periph_id uart_id = PERIPH_UART0;
+    char *buf;
+    const char *uio = NULL;
+    size_t size = DEFAULT_TX_SIZE;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "vs:u:p:")) != -1) {
+        switch (opt) {
+            case 'v':
+                // Print every byte generated and transmitted
+                verbose = true;
+                break;
+            case 's':
+                size = strtoul(optarg, NULL, 0);
+                break;
+            case 'u':
+                // Sleep on the UART interrupt rather than spin
+                uio = optarg;
+                break;
+            case 'p':
+                // The UART to use, uart0 or uart1
+                uart_id = strcmp(optarg, "uart1") ? PERIPH_UART0 :
+                                                    PERIPH_UART1;
+                break;
+            default:
+                printf("usage: %s [-v] [-s bytes] [-u /dev/uioN] "
+                       "[-p uart0|uart1]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    buf = calloc(size ? size : 1, 1);
+    if (!buf) {
+        return 1;
+    }
 
     puts(MENU_STR);
     
-    addr = map_peripheral(UART0_BASE);
-    if (!addr) {
+    uart = uio ? periph_get_uio(uart_id, uio) : periph_get(uart_id);
+    if (!uart) {
+        free(buf);
         return 1;
     }
 
     srand(time(NULL));
-    prog_loop(addr);
+    prog_loop(uart, buf, size);
 
+    periph_unmap_all();
+    if (uio_fd >= 0) {
+        close(uio_fd);
+    }
+    free(buf);
     return 0;
 }
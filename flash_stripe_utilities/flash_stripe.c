@@ -25,6 +25,40 @@
  * THE SOFTWARE.
  */
 
+/*
+ * The single image is streamed through in FLASH_STRIPE_CHUNK sized blocks,
+ * each block is transformed in memory and then written out with one syscall
+ * per file. With -m the files are instead mapped with mmap and transformed
+ * directly between the page cache mappings. With -j the image is split into
+ * chunks that a pool of threads transform independently, each reading and
+ * writing its chunk at its final offset with pread/pwrite.
+ *
+ * The transforms themselves live in libflashstripe:
+ *
+ *   gcc -O2 -pthread flash_stripe.c libflashstripe.c -o flash_stripe
+ *
+ * Erased flash is mostly 0xff and unused regions are often 0x00. With -s,
+ * runs of FLASH_STRIPE_SPARSE groups of either value skip the transform and
+ * are filled directly, as both stripe to the same value in every file. -z
+ * also leaves the zero runs of regular files as holes rather than writing
+ * them.
+ *
+ * -c prints a CRC32C of the single image, computed as it streams through.
+ * -v also unstripes every chunk of the striped files again while it is still
+ * in memory and checks the result hashes the same, validating an image in
+ * the one pass rather than a separate unstripe and cmp that reads it all
+ * back.
+ *
+ * The mode is selected on the command line:
+ *
+ *   -u  merge the N files back into the single image
+ *   -e  big endian bit ordering (reverses the file order with -b)
+ *   -b  byte wise rather than bit wise striping
+ *
+ * Building with -DUNSTRIPE, -DFLASH_STRIPE_BE or -DFLASH_STRIPE_BW still
+ * produces a binary that defaults to the matching mode.
+ */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -32,46 +66,739 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <string.h>
+#include <errno.h>
+#include <pthread.h>
 
-/* N way (num) in place bit striper. Lay out row wise bits column wise
- * (from element 0 to N-1). num is the length of x, and dir reverses the
- * direction of the transform. be determines the bit endianess scheme.
- * false to lay out bits LSB to MSB (little endian) and true for big endian.
- *
- * Best illustrated by examples:
- * Each digit in the below array is a single bit (num == 3, be == false):
- *
- * {{ 76543210, }  ----- stripe (dir == false) -----> {{ FCheb630, }
- *  { hgfedcba, }                                      { GDAfc741, }
- *  { HGFEDCBA, }} <---- upstripe (dir == true) -----  { HEBgda52, }}
- *
- * Same but with be == true:
- *
- * {{ 76543210, }  ----- stripe (dir == false) -----> {{ 741gdaFC, }
- *  { hgfedcba, }                                      { 630fcHEB, }
- *  { HGFEDCBA, }} <---- upstripe (dir == true) -----  { 52hebGDA, }}
+#include "libflashstripe.h"
+
+/* Size of a block of the single image, rounded down to a multiple of num */
+#define FLASH_STRIPE_CHUNK (4 * 1024 * 1024)
+
+/* Sparse runs in one chunk, the size of the hole flags for a chunk */
+#define FLASH_STRIPE_SPARSE_RUNS (FLASH_STRIPE_CHUNK / FLASH_STRIPE_SPARSE + 1)
+
+/* Read up to len bytes, only returning short at EOF. -1 on error */
+static ssize_t read_full(int fd, void *buf, size_t len)
+{
+    size_t done = 0;
+
+    while (done < len) {
+        ssize_t ret = read(fd, (uint8_t *)buf + done, len - done);
+
+        if (ret == 0) {
+            break;
+        } else if (ret == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        done += ret;
+    }
+    return done;
+}
+
+static int write_full(int fd, const void *buf, size_t len)
+{
+    size_t done = 0;
+
+    while (done < len) {
+        ssize_t ret = write(fd, (const uint8_t *)buf + done, len - done);
+
+        if (ret == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        done += ret; /* zero length writes just try again */
+    }
+    return 0;
+}
+
+static ssize_t pread_full(int fd, void *buf, size_t len, off_t off)
+{
+    size_t done = 0;
+
+    while (done < len) {
+        ssize_t ret = pread(fd, (uint8_t *)buf + done, len - done, off + done);
+
+        if (ret == 0) {
+            break;
+        } else if (ret == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        done += ret;
+    }
+    return done;
+}
+
+static int pwrite_full(int fd, const void *buf, size_t len, off_t off)
+{
+    size_t done = 0;
+
+    while (done < len) {
+        ssize_t ret = pwrite(fd, (const uint8_t *)buf + done, len - done,
+                             off + done);
+
+        if (ret == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        done += ret;
+    }
+    return 0;
+}
+
+/* Write len bytes of buf in runs of run bytes, skipping those flagged in
+ * hole (which may be NULL). off is the file offset for pwrite, or -1 to
+ * write sequentially and seek over the holes.
+ */
+static int write_holes(int fd, const uint8_t *buf, size_t len, off_t off,
+                       size_t run, const bool *hole)
+{
+    size_t start = 0;
+    size_t pos;
+
+    for (pos = 0; hole && pos < len; pos += run) {
+        size_t n = len - pos < run ? len - pos : run;
+
+        if (!hole[pos / run]) {
+            continue;
+        }
+        if (pos > start && (off < 0 ? write_full(fd, buf + start, pos - start)
+                            : pwrite_full(fd, buf + start, pos - start,
+                                          off + start))) {
+            return -1;
+        }
+        if (off < 0 && lseek(fd, n, SEEK_CUR) == -1) {
+            return -1;
+        }
+        start = pos + n;
+    }
+    if (len > start) {
+        return off < 0 ? write_full(fd, buf + start, len - start)
+                       : pwrite_full(fd, buf + start, len - start, off + start);
+    }
+    return 0;
+}
+
+/*
+ * -c keeps a CRC32C of the single image as it passes through, the input when
+ * striping and the output when unstriping. -v also unstripes the planes
+ * produced from it again, a sparse run at a time into a scratch buffer, so
+ * the striped files are checked from memory rather than read back.
  */
+struct stripe_check {
+    bool enabled;
+    bool verify;
+    struct flash_stripe_table inverse;
+    uint32_t crc[2];            /* of the single image, of it unstriped again */
+};
+
+static struct stripe_check check;
 
-static inline void stripe8(uint8_t *x, int num, bool dir, bool be)
+/* Scratch needed by check_chunk */
+#define CHECK_SCRATCH(num) (FLASH_STRIPE_SPARSE * (num))
+
+static uint32_t crc32c_zeros(uint32_t crc, size_t len)
 {
-    uint8_t r[num];
-    memset(r, 0, sizeof(uint8_t) * num);
-    int idx[2] = {0, 0};
-    int bit[2] = {0, be ? 7 : 0};
-    int d = dir;
+    static const uint8_t zeros[4096];
+
+    for (; len > sizeof(zeros); len -= sizeof(zeros)) {
+        crc = flash_stripe_crc32c(crc, zeros, sizeof(zeros));
+    }
+    return flash_stripe_crc32c(crc, zeros, len);
+}
 
-    for (idx[0] = 0; idx[0] < num; ++idx[0]) {
-        for (bit[0] = be ? 7 : 0; bit[0] != (be ? -1 : 8); bit[0] += be ? -1 : 1) {
-            r[idx[!d]] |= x[idx[d]] & 1 << bit[d] ? 1 << bit[!d] : 0;
-            idx[1] = (idx[1] + 1) % num;
-            if (!idx[1]) {
-                bit[1] += be ? -1 : 1;
+/*
+ * Add len bytes of the single image to crc[0] and, with planes and -v, the
+ * groups striped from them to crc[1]. Runs flagged in hole (which may be
+ * NULL) were never written and count as zeros.
+ */
+static void check_chunk(uint32_t *crc, const uint8_t *single, size_t len,
+                        uint8_t **planes, const bool *hole, uint8_t *scratch)
+{
+    int num = check.inverse.num;
+    size_t run = FLASH_STRIPE_SPARSE * num;
+    size_t pos, n;
+    int i;
+
+    if (!check.enabled) {
+        return;
+    }
+    uint8_t *sub[num];
+
+    for (pos = 0; pos < len; pos += n) {
+        bool zero = hole && hole[pos / run];
+
+        n = len - pos < run ? len - pos : run;
+        if (!planes && zero) {
+            crc[0] = crc32c_zeros(crc[0], n);
+        } else {
+            crc[0] = flash_stripe_crc32c(crc[0], single + pos, n);
+        }
+        if (!planes || !check.verify) {
+            continue;
+        }
+        if (zero) {
+            crc[1] = crc32c_zeros(crc[1], n);
+            continue;
+        }
+        for (i = 0; i < num; ++i) {
+            sub[i] = planes[i] + pos / num;
+        }
+        flash_unstripe_block(&check.inverse, sub, scratch,
+                             (n + num - 1) / num);
+        crc[1] = flash_stripe_crc32c(crc[1], scratch, n);
+    }
+}
+
+static int stripe_stream(const struct flash_stripe_table *tbl,
+                         int single, const char *single_f, int *multiple,
+                         char **multiple_f)
+{
+    int num = tbl->num;
+    size_t chunk = FLASH_STRIPE_CHUNK / num * num;
+    size_t plane_len = chunk / num;
+    uint8_t *buf = malloc(chunk * 2 + CHECK_SCRATCH(num));
+    uint8_t *planes[num];
+    bool hole[FLASH_STRIPE_SPARSE_RUNS];
+    size_t total = 0;
+    int ret = 1;
+    int i;
+
+    if (!buf) {
+        perror("malloc");
+        return 1;
+    }
+    for (i = 0; i < num; ++i) {
+        planes[i] = buf + chunk + i * plane_len;
+    }
+
+    while (true) {
+        ssize_t got = read_full(single, buf, chunk);
+        size_t groups;
+
+        if (got == -1) {
+            perror(single_f);
+            goto out;
+        } else if (got == 0) {
+            break;
+        }
+
+        if (got % num) {
+            fprintf(stderr, "WARNING:input file %s is not multiple of "
+                    "%d bytes, padding with 0xff\n", single_f, num);
+            memset(buf + got, 0xff, num - got % num);
+        }
+        groups = (got + num - 1) / num;
+
+        flash_stripe_chunk(tbl, buf, planes, groups, hole);
+
+        for (i = 0; i < num; ++i) {
+            if (write_holes(multiple[i], planes[i], groups, -1,
+                            FLASH_STRIPE_SPARSE, tbl->holes ? hole : NULL)) {
+                perror(multiple_f[i]);
+                goto out;
+            }
+        }
+        check_chunk(check.crc, buf, got, planes, tbl->holes ? hole : NULL,
+                    buf + chunk * 2);
+        total += groups;
+
+        if ((size_t)got < chunk) {
+            break;
+        }
+    }
+
+    /* Seeking over a trailing hole doesn't extend the file */
+    for (i = 0; tbl->holes && i < num; ++i) {
+        if (ftruncate(multiple[i], total)) {
+            perror(multiple_f[i]);
+            goto out;
+        }
+    }
+    ret = 0;
+out:
+    free(buf);
+    return ret;
+}
+
+static int unstripe_stream(const struct flash_stripe_table *tbl,
+                           int single, const char *single_f, int *multiple,
+                           char **multiple_f)
+{
+    int num = tbl->num;
+    size_t chunk = FLASH_STRIPE_CHUNK / num * num;
+    size_t plane_len = chunk / num;
+    uint8_t *buf = malloc(chunk * 2);
+    uint8_t *planes[num];
+    bool hole[FLASH_STRIPE_SPARSE_RUNS];
+    size_t total = 0;
+    int ret = 1;
+    int i;
+
+    if (!buf) {
+        perror("malloc");
+        return 1;
+    }
+    for (i = 0; i < num; ++i) {
+        planes[i] = buf + chunk + i * plane_len;
+    }
+
+    while (true) {
+        /* The first file determines the length, the others are padded */
+        ssize_t groups = read_full(multiple[0], planes[0], plane_len);
+
+        if (groups == -1) {
+            perror(multiple_f[0]);
+            goto out;
+        } else if (groups == 0) {
+            break;
+        }
+
+        for (i = 1; i < num; ++i) {
+            ssize_t got = read_full(multiple[i], planes[i], groups);
+
+            if (got == -1) {
+                perror(multiple_f[i]);
+                goto out;
             }
+            memset(planes[i] + got, 0xff, groups - got);
         }
+
+        flash_unstripe_chunk(tbl, planes, buf, groups, hole);
+
+        if (write_holes(single, buf, groups * num, -1,
+                        FLASH_STRIPE_SPARSE * num, tbl->holes ? hole : NULL)) {
+            perror(single_f);
+            goto out;
+        }
+        check_chunk(check.crc, buf, groups * num, NULL,
+                    tbl->holes ? hole : NULL, NULL);
+        total += groups * num;
+
+        if ((size_t)groups < plane_len) {
+            break;
+        }
+    }
+
+    /* Seeking over a trailing hole doesn't extend the file */
+    if (tbl->holes && ftruncate(single, total)) {
+        perror(single_f);
+        goto out;
     }
-    memcpy(x, r, sizeof(uint8_t) * num);
+    ret = 0;
+out:
+    free(buf);
+    return ret;
+}
+
+/* Map len bytes of fd, read only for inputs, shared writable for outputs */
+static uint8_t *map_file(int fd, size_t len, bool out)
+{
+    void *addr = mmap(NULL, len, out ? PROT_READ | PROT_WRITE : PROT_READ,
+                      MAP_SHARED, fd, 0);
+
+    if (addr == MAP_FAILED) {
+        return NULL;
+    }
+    madvise(addr, len, MADV_SEQUENTIAL);
+    return addr;
+}
+
+/* Size an output file and map it. The blocks are allocated up front so a
+ * full disk is reported here rather than as a SIGBUS mid transform, unless
+ * the file is to keep its holes.
+ */
+static uint8_t *map_output(int fd, size_t len, bool holes)
+{
+    int err;
+
+    if (ftruncate(fd, len)) {
+        return NULL;
+    }
+    err = holes ? 0 : posix_fallocate(fd, 0, len);
+    if (err && err != EOPNOTSUPP && err != EINVAL) {
+        errno = err;
+        return NULL;
+    }
+    return map_file(fd, len, true);
+}
+
+static int stripe_mmap(const struct flash_stripe_table *tbl,
+                       int single, const char *single_f, int *multiple,
+                       char **multiple_f)
+{
+    size_t num = tbl->num;
+    struct stat st;
+    uint8_t *in;
+    uint8_t *planes[num];
+    uint8_t tail[num];
+    uint8_t *scratch = NULL;
+    bool hole[FLASH_STRIPE_SPARSE_RUNS];
+    size_t groups, full, g, n;
+    int ret = 1;
+    size_t i;
+
+    if (fstat(single, &st)) {
+        perror(single_f);
+        return 1;
+    }
+    if (!st.st_size) {
+        return 0;
+    }
+    groups = (st.st_size + num - 1) / num;
+    full = st.st_size / num;
+
+    in = map_file(single, st.st_size, false);
+    if (!in) {
+        perror(single_f);
+        return 1;
+    }
+    memset(planes, 0, sizeof(planes));
+    if (check.verify && !(scratch = malloc(CHECK_SCRATCH(num)))) {
+        perror("malloc");
+        goto out;
+    }
+    for (i = 0; i < num; ++i) {
+        planes[i] = map_output(multiple[i], groups, tbl->holes);
+        if (!planes[i]) {
+            perror(multiple_f[i]);
+            goto out;
+        }
+    }
+
+    /* A freshly truncated file reads as zeros, holes need no work */
+    for (g = 0; g < full; g += n) {
+        uint8_t *sub[num];
+
+        n = full - g < FLASH_STRIPE_CHUNK ? full - g : FLASH_STRIPE_CHUNK;
+        for (i = 0; i < num; ++i) {
+            sub[i] = planes[i] + g;
+        }
+        flash_stripe_chunk(tbl, in + g * num, sub, n, hole);
+        check_chunk(check.crc, in + g * num, n * num, sub,
+                    tbl->holes ? hole : NULL, scratch);
+    }
+
+    if (full != groups) {
+        uint8_t *last[num];
+
+        fprintf(stderr, "WARNING:input file %s is not multiple of "
+                "%zu bytes, padding with 0xff\n", single_f, num);
+        memset(tail, 0xff, num);
+        memcpy(tail, in + full * num, st.st_size % num);
+        for (i = 0; i < num; ++i) {
+            last[i] = planes[i] + full;
+        }
+        flash_stripe_block(tbl, tail, last, 1);
+        check_chunk(check.crc, tail, st.st_size % num, last, NULL, scratch);
+    }
+    ret = 0;
+out:
+    for (i = 0; i < num && planes[i]; ++i) {
+        munmap(planes[i], groups);
+    }
+    munmap(in, st.st_size);
+    free(scratch);
+    return ret;
+}
+
+static int unstripe_mmap(const struct flash_stripe_table *tbl,
+                         int single, const char *single_f, int *multiple,
+                         char **multiple_f)
+{
+    int num = tbl->num;
+    struct stat st;
+    uint8_t *out = NULL;
+    uint8_t *planes[num];
+    size_t lens[num];
+    bool hole[FLASH_STRIPE_SPARSE_RUNS];
+    size_t groups = 0, full, g, n;
+    int ret = 1;
+    int i;
+
+    /* The first file determines the length, the others are padded */
+    memset(planes, 0, sizeof(planes));
+    for (i = 0; i < num; ++i) {
+        if (fstat(multiple[i], &st)) {
+            perror(multiple_f[i]);
+            goto out;
+        }
+        lens[i] = st.st_size;
+        if (i && lens[i] > lens[0]) {
+            lens[i] = lens[0];
+        }
+        if (!lens[i]) {
+            continue;
+        }
+        planes[i] = map_file(multiple[i], lens[i], false);
+        if (!planes[i]) {
+            perror(multiple_f[i]);
+            goto out;
+        }
+    }
+    groups = lens[0];
+    if (!groups) {
+        ret = 0;
+        goto out;
+    }
+    full = groups;
+    for (i = 1; i < num; ++i) {
+        if (lens[i] < full) {
+            full = lens[i];
+        }
+    }
+
+    out = map_output(single, groups * num, tbl->holes);
+    if (!out) {
+        perror(single_f);
+        goto out;
+    }
+
+    for (g = 0; g < full; g += n) {
+        uint8_t *sub[num];
+
+        n = full - g < FLASH_STRIPE_CHUNK ? full - g : FLASH_STRIPE_CHUNK;
+        for (i = 0; i < num; ++i) {
+            sub[i] = planes[i] + g;
+        }
+        flash_unstripe_chunk(tbl, sub, out + g * num, n, hole);
+        check_chunk(check.crc, out + g * num, n * num, NULL,
+                    tbl->holes ? hole : NULL, NULL);
+    }
+
+    for (; full < groups; ++full) {
+        uint8_t pad[num];
+        uint8_t *last[num];
+
+        for (i = 0; i < num; ++i) {
+            pad[i] = full < lens[i] ? planes[i][full] : 0xff;
+            last[i] = &pad[i];
+        }
+        flash_unstripe_block(tbl, last, out + full * num, 1);
+        check_chunk(check.crc, out + full * num, num, NULL, NULL, NULL);
+    }
+    ret = 0;
+out:
+    if (out) {
+        munmap(out, groups * num);
+    }
+    for (i = 0; i < num; ++i) {
+        if (planes[i]) {
+            munmap(planes[i], lens[i]);
+        }
+    }
+    return ret;
+}
+
+/* Work shared by the -j thread pool, chunks are handed out in order */
+struct stripe_pool {
+    const struct flash_stripe_table *tbl;
+    bool unstripe;
+    int single;
+    const char *single_f;
+    int *multiple;
+    char **multiple_f;
+    size_t single_len;      /* stripe: bytes in the single image */
+    const size_t *lens;     /* unstripe: bytes in each striped file */
+    size_t groups;
+    size_t chunk_groups;
+    size_t chunks;
+    size_t next;
+    uint32_t (*crcs)[2];    /* per chunk with -c, combined in order after */
+    bool failed;            /* set and read with __atomic_* */
+};
+
+static void *stripe_pool_worker(void *opaque)
+{
+    struct stripe_pool *p = opaque;
+    int num = p->tbl->num;
+    uint8_t *buf = malloc(p->chunk_groups * num * 2 + CHECK_SCRATCH(num));
+    uint8_t *planes[num];
+    bool hole[FLASH_STRIPE_SPARSE_RUNS];
+    size_t c;
+    int i;
+
+    if (!buf) {
+        perror("malloc");
+        __atomic_store_n(&p->failed, true, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    for (i = 0; i < num; ++i) {
+        planes[i] = buf + p->chunk_groups * (num + i);
+    }
+
+    while (!__atomic_load_n(&p->failed, __ATOMIC_RELAXED) &&
+           (c = __atomic_fetch_add(&p->next, 1, __ATOMIC_RELAXED)) <
+           p->chunks) {
+        size_t g0 = c * p->chunk_groups;
+        size_t groups = p->groups - g0 < p->chunk_groups ? p->groups - g0
+                                                         : p->chunk_groups;
+        size_t got;
+
+        if (p->unstripe) {
+            for (i = 0; i < num; ++i) {
+                got = p->lens[i] > g0 ? p->lens[i] - g0 : 0;
+                got = got < groups ? got : groups;
+                if (got && (size_t)pread_full(p->multiple[i], planes[i],
+                                              got, g0) != got) {
+                    perror(p->multiple_f[i]);
+                    goto fail;
+                }
+                memset(planes[i] + got, 0xff, groups - got);
+            }
+            flash_unstripe_chunk(p->tbl, planes, buf, groups, hole);
+            if (write_holes(p->single, buf, groups * num, g0 * num,
+                            FLASH_STRIPE_SPARSE * num,
+                            p->tbl->holes ? hole : NULL)) {
+                perror(p->single_f);
+                goto fail;
+            }
+            check_chunk(p->crcs[c], buf, groups * num, NULL,
+                        p->tbl->holes ? hole : NULL, NULL);
+        } else {
+            got = p->single_len - g0 * num;
+            got = got < groups * num ? got : groups * num;
+            if ((size_t)pread_full(p->single, buf, got, g0 * num) != got) {
+                perror(p->single_f);
+                goto fail;
+            }
+            memset(buf + got, 0xff, groups * num - got);
+            flash_stripe_chunk(p->tbl, buf, planes, groups, hole);
+            for (i = 0; i < num; ++i) {
+                if (write_holes(p->multiple[i], planes[i], groups, g0,
+                                FLASH_STRIPE_SPARSE,
+                                p->tbl->holes ? hole : NULL)) {
+                    perror(p->multiple_f[i]);
+                    goto fail;
+                }
+            }
+            check_chunk(p->crcs[c], buf, got, planes,
+                        p->tbl->holes ? hole : NULL,
+                        buf + p->chunk_groups * num * 2);
+        }
+    }
+    free(buf);
+    return NULL;
+fail:
+    __atomic_store_n(&p->failed, true, __ATOMIC_RELAXED);
+    free(buf);
+    return NULL;
+}
+
+static int stripe_threads(const struct flash_stripe_table *tbl,
+                          bool unstripe, int jobs, int single,
+                          const char *single_f, int *multiple,
+                          char **multiple_f)
+{
+    int num = tbl->num;
+    struct stripe_pool p = {
+        .tbl = tbl,
+        .unstripe = unstripe,
+        .single = single,
+        .single_f = single_f,
+        .multiple = multiple,
+        .multiple_f = multiple_f,
+        .chunk_groups = FLASH_STRIPE_CHUNK / num,
+    };
+    pthread_t threads[jobs];
+    size_t lens[num];
+    struct stat st;
+    size_t c, len;
+    int started;
+    int i;
+
+    /* The first striped file determines the length, the others are padded */
+    for (i = 0; i < (unstripe ? num : 1); ++i) {
+        int fd = unstripe ? multiple[i] : single;
+
+        if (fstat(fd, &st)) {
+            perror(unstripe ? multiple_f[i] : single_f);
+            return 1;
+        }
+        lens[i] = st.st_size;
+    }
+    if (unstripe) {
+        p.lens = lens;
+        p.groups = lens[0];
+    } else {
+        p.single_len = lens[0];
+        p.groups = (lens[0] + num - 1) / num;
+        if (lens[0] % num) {
+            fprintf(stderr, "WARNING:input file %s is not multiple of "
+                    "%d bytes, padding with 0xff\n", single_f, num);
+        }
+    }
+    p.chunks = (p.groups + p.chunk_groups - 1) / p.chunk_groups;
+    p.crcs = calloc(p.chunks + 1, sizeof(*p.crcs));
+    if (!p.crcs) {
+        perror("calloc");
+        return 1;
+    }
+
+    /* Size the outputs up front rather than growing them from each thread */
+    for (i = 0; i < (unstripe ? 1 : num); ++i) {
+        if (ftruncate(unstripe ? single : multiple[i],
+                      unstripe ? p.groups * num : p.groups)) {
+            perror(unstripe ? single_f : multiple_f[i]);
+            free(p.crcs);
+            return 1;
+        }
+    }
+
+    for (started = 0; started < jobs; ++started) {
+        if (pthread_create(&threads[started], NULL, stripe_pool_worker, &p)) {
+            break;
+        }
+    }
+    if (!started) {
+        stripe_pool_worker(&p);
+    }
+    for (i = 0; i < started; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+
+    for (c = 0; check.enabled && c < p.chunks; ++c) {
+        len = (p.groups - c * p.chunk_groups < p.chunk_groups ?
+               p.groups - c * p.chunk_groups : p.chunk_groups) * num;
+        if (!unstripe && c == p.chunks - 1) {
+            len -= p.groups * num - p.single_len;
+        }
+        for (i = 0; i < 2; ++i) {
+            check.crc[i] = flash_stripe_crc32c_combine(check.crc[i],
+                                                       p.crcs[c][i], len);
+        }
+    }
+    free(p.crcs);
+    return p.failed;
+}
+
+#ifndef FLASH_STRIPE_NO_MAIN
+static void usage(const char *exe_name)
+{
+    fprintf(stderr, "usage: %s [-u] [-e] [-b] [-s] [-z] [-c] [-v] "
+            "[-m | -j threads] single multiple0 [multiple1 ...]\n"
+            "  -u  unstripe the multiple files into single\n"
+            "  -e  big endian bit order, or reversed file order with -b\n"
+            "  -b  stripe whole bytes rather than bits\n"
+            "  -m  map the files with mmap instead of streaming them\n"
+            "  -j  transform chunks in parallel on this many threads\n"
+            "  -s  fill all 0x00 and all 0xff runs without transforming\n"
+            "  -z  as -s, leaving the 0x00 runs as holes\n"
+            "  -c  print the CRC32C of the single image\n"
+            "  -v  as -c, checking the striped files unstripe back to it\n",
+            exe_name);
 }
 
 int main (int argc, char *argv []) {
@@ -87,14 +814,78 @@ int main (int argc, char *argv []) {
     bool be = false;
 #endif
 
+#ifdef FLASH_STRIPE_BW
+    bool bw = true;
+#else
+    bool bw = false;
+#endif
+
+    static struct flash_stripe_table tbl;
+    bool use_mmap = false;
+    bool sparse = false;
+    bool holes = false;
+    bool regular = true;
+    int jobs = 1;
+    struct stat st;
     int i;
+    int ret;
+    int c;
 
     const char *exe_name = argv[0];
-    argc--;
-    argv++;
+
+    while ((c = getopt(argc, argv, "uebmj:szcv")) != -1) {
+        switch (c) {
+        case 'u':
+            unstripe = true;
+            break;
+        case 'e':
+            be = true;
+            break;
+        case 'b':
+            bw = true;
+            break;
+        case 'm':
+            use_mmap = true;
+            break;
+        case 'j':
+            jobs = atoi(optarg);
+            if (jobs < 1) {
+                fprintf(stderr, "ERROR: invalid thread count %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'z':
+            holes = true;
+            /* fall through */
+        case 's':
+            sparse = true;
+            break;
+        case 'v':
+            check.verify = true;
+            /* fall through */
+        case 'c':
+            check.enabled = true;
+            break;
+        default:
+            usage(exe_name);
+            return 1;
+        }
+    }
+    argc -= optind;
+    argv += optind;
+
+    if (use_mmap && jobs > 1) {
+        fprintf(stderr, "ERROR: -m and -j can't be combined\n");
+        return 1;
+    }
+    if (unstripe && check.verify) {
+        fprintf(stderr, "ERROR: -v only applies to striping\n");
+        return 1;
+    }
 
     if (argc < 2) {
         fprintf(stderr, "ERROR: %s requires at least two args\n", exe_name);
+        usage(exe_name);
         return 1;
     }
 
@@ -102,7 +893,8 @@ int main (int argc, char *argv []) {
     int single;
     
     if (unstripe) {
-        single = creat(single_f, 0644);
+        single = open(single_f, O_CREAT | O_TRUNC |
+                      (use_mmap ? O_RDWR : O_WRONLY), 0644);
     } else {
         single = open(single_f, 0);
     }
@@ -120,7 +912,8 @@ int main (int argc, char *argv []) {
         if (unstripe) {
             multiple[i] = open(argv[i], 0);
         } else {
-            multiple[i] = creat(argv[i], 0644);
+            multiple[i] = open(argv[i], O_CREAT | O_TRUNC |
+                               (use_mmap ? O_RDWR : O_WRONLY), 0644);
         }
         if (multiple[i] == -1) {
             perror(argv[i]);
@@ -128,52 +921,51 @@ int main (int argc, char *argv []) {
         }
     }
 
-    while (true) {
-        uint8_t buf[argc];
-        for (i = 0; i < argc; ++i) {
-            switch (read(!unstripe ? single : multiple[
-#if defined(FLASH_STRIPE_BW) && defined (FLASH_STRIPE_BE)
-                                                       argc - 1 -
-#endif
-                                                       i], &buf[i], 1)) {
-            case 0:
-                if (i == 0) {
-                    goto done;
-                } else if (!unstripe) {
-                    fprintf(stderr, "WARNING:input file %s is not multiple of "
-                            "%d bytes, padding with garbage byte\n", single_f,
-                            argc);
-                }
-                break;
-            case -1:
-                perror(unstripe ? argv[i] : single_f);
-                return 1;
-            }
+    /* Pipes and character devices can't be mapped, accessed at random
+     * offsets or have holes, stream those instead
+     */
+    for (i = -1; i < argc; ++i) {
+        if (fstat(i < 0 ? single : multiple[i], &st) || !S_ISREG(st.st_mode)) {
+            regular = false;
         }
+    }
+    if (!regular) {
+        use_mmap = false;
+        holes = false;
+        jobs = 1;
+    }
 
-#ifndef FLASH_STRIPE_BW
-        stripe8(buf, argc, unstripe, be);
-#endif
+    flash_stripe_table_init(&tbl, argc, unstripe, be, bw);
+    tbl.sparse = sparse;
+    tbl.holes = holes;
+    flash_stripe_table_init(&check.inverse, argc, !unstripe, be, bw);
 
-        for (i = 0; i < argc; ++i) {
-            switch (write(unstripe ? single : multiple[
-#if defined(FLASH_STRIPE_BW) && defined (FLASH_STRIPE_BE)
-                                                       argc - 1 -
-#endif
-                                                       i], &buf[i], 1)) {
-            case -1:
-                perror(unstripe ? single_f : argv[i]);
-                return 1;
-            case 0:
-                i--; /* try again */
-            }
-        }
+    if (jobs > 1) {
+        ret = stripe_threads(&tbl, unstripe, jobs, single, single_f, multiple,
+                             argv);
+    } else if (use_mmap && unstripe) {
+        ret = unstripe_mmap(&tbl, single, single_f, multiple, argv);
+    } else if (use_mmap) {
+        ret = stripe_mmap(&tbl, single, single_f, multiple, argv);
+    } else if (unstripe) {
+        ret = unstripe_stream(&tbl, single, single_f, multiple, argv);
+    } else {
+        ret = stripe_stream(&tbl, single, single_f, multiple, argv);
+    }
+
+    if (!ret && check.enabled) {
+        printf("%08x  %s\n", check.crc[0], single_f);
+    }
+    if (!ret && check.verify && check.crc[1] != check.crc[0]) {
+        fprintf(stderr, "ERROR: striped files do not unstripe back to %s "
+                "(crc32c %08x)\n", single_f, check.crc[1]);
+        ret = 1;
     }
 
-done:
     close(single);
     for (i = 0; i < argc; ++i) {
-        close(multiple[argc]);
+        close(multiple[i]);
     }
-    return 0;
+    return ret;
 }
+#endif
@@ -0,0 +1,846 @@
+/*
+ * Throughput benchmark suite for flash_stripe.
+ *
+ * Copyright (c) 2026 Xilinx Inc
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Times every mode of flash_stripe (stripe and unstripe, bit and byte wise,
+ * little and big endian, for each file count) with each I/O engine on
+ * synthetic images, and prints one JSON object per run. The images are
+ *
+ *   random  incompressible data, the worst case for the transform
+ *   erased  all 0xff, a blank flash
+ *   mixed   64KiB blocks of random data, 0xff and 0x00 in roughly 2:1:1
+ *           proportion, as a typical partially filled image
+ *
+ * and the engines are the original one byte per syscall loop (per_byte, only
+ * for images up to -l bytes), the default streaming engine (stream), -m
+ * (mmap), -j (threads) and the library context API with the outputs kept in
+ * memory (memory). Each engine other than per_byte also runs with -z, as
+ * "sparse": true.
+ *
+ * The stream engine runs first as the reference, every other run must produce
+ * identical output or it is reported with "ok": false. Before timing, the
+ * lookup kernels are checked bit for bit against flash_stripe8 for every
+ * group size, mode and direction. -t runs only that check and exits non-zero
+ * on a mismatch, as a test:
+ *
+ *   ./flash_stripe_bench -t
+ *
+ *   gcc -O2 -pthread flash_stripe_bench.c libflashstripe.c \
+ *       -o flash_stripe_bench
+ *   ./flash_stripe_bench [-s sizes] [-n nums] [-i images] [-E engines]
+ *                        [-j threads] [-l per byte limit] [-d dir] > out.json
+ *
+ * Lists are comma separated and sizes take a K, M or G suffix, so a full
+ * sweep is -s 1M,16M,256M,4G. The defaults are -s 1M,16M -n 2,4,8 -j 4 -l 1M
+ * with every image and engine. Files go in a fresh directory under -d (/tmp),
+ * which needs room for about three times the largest size.
+ *
+ * syscalls counts the read and write syscalls of the run from /proc/self/io,
+ * and is null where that is not available. The mmap and memory engines map
+ * their inputs, so make next to none.
+ */
+
+#define FLASH_STRIPE_NO_MAIN
+#include "flash_stripe.c"
+
+#include <inttypes.h>
+#include <time.h>
+
+#define BENCH_MAX_FILES FLASH_STRIPE_TABLE_MAX
+#define BENCH_MAX_SIZES 16
+#define BENCH_PATH_MAX 4096
+
+/* Unit images are generated and compared in */
+#define BENCH_BLOCK (1024 * 1024)
+
+/* Granularity of the mixed image */
+#define BENCH_MIXED_BLOCK (64 * 1024)
+
+enum image {
+    IMAGE_RANDOM,
+    IMAGE_ERASED,
+    IMAGE_MIXED,
+    IMAGE_MAX,
+};
+
+static const char *image_names[IMAGE_MAX] = {
+    [IMAGE_RANDOM] = "random",
+    [IMAGE_ERASED] = "erased",
+    [IMAGE_MIXED] = "mixed",
+};
+
+enum engine {
+    ENGINE_PER_BYTE,
+    ENGINE_STREAM,
+    ENGINE_MMAP,
+    ENGINE_THREADS,
+    ENGINE_MEMORY,
+    ENGINE_MAX,
+};
+
+static const char *engine_names[ENGINE_MAX] = {
+    [ENGINE_PER_BYTE] = "per_byte",
+    [ENGINE_STREAM] = "stream",
+    [ENGINE_MMAP] = "mmap",
+    [ENGINE_THREADS] = "threads",
+    [ENGINE_MEMORY] = "memory",
+};
+
+/* One timed run, one JSON object in the output */
+struct result {
+    enum image image;
+    size_t size;
+    int num;
+    bool unstripe;
+    bool bw;
+    bool be;
+    enum engine engine;
+    bool sparse;
+    double seconds;
+    int64_t syscalls;
+    bool ok;
+};
+
+static int jobs = 4;
+static size_t per_byte_limit = 1024 * 1024;
+static char dir[BENCH_PATH_MAX - 64];
+static int64_t syscall_overhead;
+static bool first_result = true;
+
+/* The original per byte loop, kept as the baseline to measure against */
+static int legacy_stream(int single, int *multiple, int num, bool unstripe,
+                         bool be, bool bw)
+{
+    int i;
+
+    while (true) {
+        uint8_t buf[num];
+        for (i = 0; i < num; ++i) {
+            switch (read(!unstripe ? single : multiple[bw && be ?
+                                                       num - 1 - i : i],
+                         &buf[i], 1)) {
+            case 0:
+                if (i == 0) {
+                    return 0;
+                }
+                /* pad the last group with 0xff, as the engines do */
+                memset(&buf[i], 0xff, num - i);
+                i = num;
+                break;
+            case -1:
+                return 1;
+            }
+        }
+
+        if (!bw) {
+            flash_stripe8(buf, num, unstripe, be);
+        }
+
+        for (i = 0; i < num; ++i) {
+            switch (write(unstripe ? single : multiple[bw && be ?
+                                                       num - 1 - i : i],
+                          &buf[i], 1)) {
+            case -1:
+                return 1;
+            case 0:
+                i--; /* try again */
+            }
+        }
+    }
+}
+
+/* Check the block kernels match flash_stripe8 (or a plain byte copy) for each
+ * mode on random groups
+ */
+static bool check_kernels(void)
+{
+    static struct flash_stripe_table tbl;
+    uint8_t in[FLASH_STRIPE_TABLE_MAX * 64], out[FLASH_STRIPE_TABLE_MAX * 64];
+    uint8_t planes_buf[FLASH_STRIPE_TABLE_MAX][64];
+    uint8_t *planes[FLASH_STRIPE_TABLE_MAX];
+    uint8_t ref[FLASH_STRIPE_TABLE_MAX];
+    int num, dir, be, bw, g, i;
+    bool ok = true;
+
+    for (i = 0; i < (int)sizeof(in); ++i) {
+        in[i] = rand();
+    }
+    for (i = 0; i < FLASH_STRIPE_TABLE_MAX; ++i) {
+        planes[i] = planes_buf[i];
+    }
+
+    for (num = 1; num <= FLASH_STRIPE_TABLE_MAX; ++num) {
+        for (dir = 0; dir < 4; ++dir) {
+            for (be = 0; be < 2; ++be) {
+                bw = dir >> 1;
+                flash_stripe_table_init(&tbl, num, dir & 1, be, bw);
+                for (i = 0; i < num; ++i) {
+                    memcpy(planes[i], in + i * 64, 64);
+                }
+                if (dir & 1) {
+                    flash_unstripe_block(&tbl, planes, out, 64);
+                } else {
+                    flash_stripe_block(&tbl, in, planes, 64);
+                }
+                for (g = 0; g < 64; ++g) {
+                    for (i = 0; i < num; ++i) {
+                        int k = bw && be ? num - 1 - i : i;
+
+                        ref[i] = dir & 1 ? in[k * 64 + g] : in[g * num + k];
+                    }
+                    if (!bw) {
+                        flash_stripe8(ref, num, dir & 1, be);
+                    }
+                    for (i = 0; i < num; ++i) {
+                        if (ref[i] != (dir & 1 ? out[g * num + i]
+                                               : planes[i][g])) {
+                            fprintf(stderr, "kernel mismatch: num %d %s "
+                                    "%s %s\n", num,
+                                    dir & 1 ? "unstripe" : "stripe",
+                                    bw ? "bytes" : "bits", be ? "be" : "le");
+                            ok = false;
+                            g = 64;
+                            break;
+                        }
+                    }
+                }
+            }
+        }
+    }
+    return ok;
+}
+
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Read and write syscalls made by the process so far, -1 if unknown */
+static int64_t syscalls(void)
+{
+    FILE *f = fopen("/proc/self/io", "r");
+    char line[128];
+    int64_t v, n = 0;
+    int found = 0;
+
+    if (!f) {
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "syscr: %" SCNd64, &v) == 1 ||
+            sscanf(line, "syscw: %" SCNd64, &v) == 1) {
+            n += v;
+            found++;
+        }
+    }
+    fclose(f);
+    return found == 2 ? n : -1;
+}
+
+static uint64_t xorshift64(uint64_t *s)
+{
+    *s ^= *s << 13;
+    *s ^= *s >> 7;
+    *s ^= *s << 17;
+    return *s;
+}
+
+/* Fill len bytes of image from offset off, both multiples of 8 */
+static void fill_image(enum image image, uint8_t *buf, size_t off, size_t len,
+                       uint64_t *seed)
+{
+    size_t i, j, n;
+
+    if (image == IMAGE_ERASED) {
+        memset(buf, 0xff, len);
+        return;
+    }
+    for (i = 0; i < len; i += n) {
+        uint64_t block = (off + i) / BENCH_MIXED_BLOCK;
+        /* The first block stays random so the image never starts blank */
+        int kind = image == IMAGE_MIXED && block ?
+                   (block * 0x9e3779b97f4a7c15ull) >> 62 : 0;
+
+        n = BENCH_MIXED_BLOCK - (off + i) % BENCH_MIXED_BLOCK;
+        n = n < len - i ? n : len - i;
+        if (kind == 2) {
+            memset(buf + i, 0xff, n);
+        } else if (kind == 3) {
+            memset(buf + i, 0x00, n);
+        } else {
+            for (j = 0; j < n; j += 8) {
+                uint64_t r = xorshift64(seed);
+
+                memcpy(buf + i + j, &r, 8);
+            }
+        }
+    }
+}
+
+static int make_image(const char *path, enum image image, size_t size)
+{
+    uint64_t seed = 0x2545f4914f6cdd1dull;
+    uint8_t *buf = malloc(BENCH_BLOCK);
+    size_t off, len;
+    int ret = 1;
+    int fd;
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1 || !buf) {
+        perror(path);
+        goto out;
+    }
+    for (off = 0; off < size; off += len) {
+        len = size - off < BENCH_BLOCK ? size - off : BENCH_BLOCK;
+        fill_image(image, buf, off, (len + 7) & ~(size_t)7, &seed);
+        if (write_full(fd, buf, len)) {
+            perror(path);
+            goto out;
+        }
+    }
+    ret = 0;
+out:
+    if (fd != -1) {
+        close(fd);
+    }
+    free(buf);
+    return ret;
+}
+
+/*
+ * Compare two files. With len -1 they must be identical, otherwise only their
+ * first len bytes are compared.
+ */
+static bool same_file(const char *a, const char *b, off_t len)
+{
+    uint8_t *ba = malloc(BENCH_BLOCK);
+    uint8_t *bb = malloc(BENCH_BLOCK);
+    int fa = open(a, O_RDONLY);
+    int fb = open(b, O_RDONLY);
+    bool same = ba && bb && fa != -1 && fb != -1;
+    off_t done = 0;
+
+    while (same && (len < 0 || done < len)) {
+        size_t want = len < 0 || len - done > BENCH_BLOCK ? BENCH_BLOCK
+                                                          : len - done;
+        ssize_t ra = read_full(fa, ba, want);
+        ssize_t rb = read_full(fb, bb, want);
+
+        same = ra == rb && ra != -1 && !memcmp(ba, bb, ra);
+        if (ra < 0 || (size_t)ra < want) {
+            same &= len < 0;
+            break;
+        }
+        done += ra;
+    }
+    if (fa != -1) {
+        close(fa);
+    }
+    if (fb != -1) {
+        close(fb);
+    }
+    free(ba);
+    free(bb);
+    return same;
+}
+
+static void print_result(const struct result *r)
+{
+    double mb = r->size / 1e6;
+
+    printf("%s{\"image\": \"%s\", \"size\": %zu, \"num\": %d, "
+           "\"mode\": \"%s\", \"bw\": %s, \"be\": %s, \"engine\": \"%s\", "
+           "\"threads\": %d, \"sparse\": %s, \"seconds\": %.6f, "
+           "\"mb_per_s\": %.2f, ",
+           first_result ? "[\n" : ",\n", image_names[r->image], r->size,
+           r->num, r->unstripe ? "unstripe" : "stripe",
+           r->bw ? "true" : "false", r->be ? "true" : "false",
+           engine_names[r->engine], r->engine == ENGINE_THREADS ? jobs : 1,
+           r->sparse ? "true" : "false", r->seconds,
+           r->seconds > 0 ? mb / r->seconds : 0);
+    if (r->syscalls < 0) {
+        printf("\"syscalls\": null, \"syscalls_per_mb\": null, ");
+    } else {
+        printf("\"syscalls\": %" PRId64 ", \"syscalls_per_mb\": %.3f, ",
+               r->syscalls, r->syscalls / mb);
+    }
+    printf("\"ok\": %s}", r->ok ? "true" : "false");
+    fflush(stdout);
+    first_result = false;
+}
+
+/* <dir>/<tag>.single and <dir>/<tag>.<i> */
+static void single_name(char *buf, const char *tag)
+{
+    snprintf(buf, BENCH_PATH_MAX, "%s/%s.single", dir, tag);
+}
+
+static void plane_name(char *buf, const char *tag, int i)
+{
+    snprintf(buf, BENCH_PATH_MAX, "%s/%s.%d", dir, tag, i);
+}
+
+static void remove_files(const char *tag, int num)
+{
+    char name[BENCH_PATH_MAX];
+    int i;
+
+    single_name(name, tag);
+    unlink(name);
+    for (i = 0; i < num; ++i) {
+        plane_name(name, tag, i);
+        unlink(name);
+    }
+}
+
+/*
+ * Run one direction of r with a file engine, from the in_tag files to the
+ * out_tag files. Fills in the timing, returns non zero on failure.
+ */
+static int run_files(struct result *r, const char *in_tag,
+                     const char *out_tag)
+{
+    static struct flash_stripe_table tbl;
+    char names[BENCH_MAX_FILES][BENCH_PATH_MAX];
+    char *multiple_f[BENCH_MAX_FILES];
+    char single_f[BENCH_PATH_MAX];
+    int multiple[BENCH_MAX_FILES];
+    int num = r->num;
+    int64_t calls;
+    double start;
+    int single;
+    int ret;
+    int i;
+
+    single_name(single_f, r->unstripe ? out_tag : in_tag);
+    single = r->unstripe ? open(single_f, O_RDWR | O_CREAT | O_TRUNC, 0644)
+                         : open(single_f, O_RDONLY);
+    if (single == -1) {
+        perror(single_f);
+        return 1;
+    }
+    for (i = 0; i < num; ++i) {
+        plane_name(names[i], r->unstripe ? in_tag : out_tag, i);
+        multiple_f[i] = names[i];
+        multiple[i] = r->unstripe ? open(names[i], O_RDONLY)
+                                  : open(names[i], O_RDWR | O_CREAT | O_TRUNC,
+                                         0644);
+        if (multiple[i] == -1) {
+            perror(names[i]);
+            return 1;
+        }
+    }
+
+    flash_stripe_table_init(&tbl, num, r->unstripe, r->be, r->bw);
+    tbl.sparse = r->sparse;
+    tbl.holes = r->sparse;
+
+    calls = syscalls();
+    start = now();
+    if (r->engine == ENGINE_PER_BYTE) {
+        ret = legacy_stream(single, multiple, num, r->unstripe, r->be, r->bw);
+    } else if (r->engine == ENGINE_THREADS) {
+        ret = stripe_threads(&tbl, r->unstripe, jobs, single, single_f,
+                             multiple, multiple_f);
+    } else if (r->engine == ENGINE_MMAP && r->unstripe) {
+        ret = unstripe_mmap(&tbl, single, single_f, multiple, multiple_f);
+    } else if (r->engine == ENGINE_MMAP) {
+        ret = stripe_mmap(&tbl, single, single_f, multiple, multiple_f);
+    } else if (r->unstripe) {
+        ret = unstripe_stream(&tbl, single, single_f, multiple, multiple_f);
+    } else {
+        ret = stripe_stream(&tbl, single, single_f, multiple, multiple_f);
+    }
+    r->seconds = now() - start;
+    r->syscalls = calls < 0 ? -1 : syscalls() - calls - syscall_overhead;
+
+    close(single);
+    for (i = 0; i < num; ++i) {
+        close(multiple[i]);
+    }
+    return ret;
+}
+
+/* Map all of a non empty file read only. NULL on failure */
+static uint8_t *map_whole(const char *path, size_t *len)
+{
+    uint8_t *addr = NULL;
+    struct stat st;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd != -1 && !fstat(fd, &st) && st.st_size) {
+        *len = st.st_size;
+        addr = map_file(fd, *len, false);
+    }
+    if (!addr) {
+        perror(path);
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+    return addr;
+}
+
+/*
+ * Run one direction of r through the flash_stripe context API, from a mapping
+ * of the input into chunk sized buffers that are checked against the ref
+ * files rather than written out. Only the feed calls are timed.
+ */
+static int run_memory(struct result *r)
+{
+    static struct flash_stripe fs;
+    const uint8_t *in[BENCH_MAX_FILES];
+    uint8_t *planes[BENCH_MAX_FILES] = { NULL };
+    uint8_t *out[BENCH_MAX_FILES] = { NULL };
+    uint8_t *single = NULL, *merged = NULL;
+    size_t single_len = 0, plane_len = 0;
+    size_t step = FLASH_STRIPE_CHUNK / r->num;
+    size_t off, len, pos, n;
+    ssize_t got;
+    char name[BENCH_PATH_MAX];
+    int64_t calls;
+    double start;
+    int ret = 1;
+    int i;
+
+    single_name(name, "in");
+    single = map_whole(name, &single_len);
+    for (i = 0; single && i < r->num; ++i) {
+        plane_name(name, "ref", i);
+        planes[i] = map_whole(name, &plane_len);
+        out[i] = malloc(step + 1);
+        if (!planes[i] || !out[i]) {
+            goto out;
+        }
+    }
+    merged = malloc(step * r->num);
+    if (!single || !merged ||
+        flash_stripe_init(&fs, r->num, r->unstripe, r->be, r->bw, r->sparse)) {
+        goto out;
+    }
+
+    r->seconds = 0;
+    r->ok = true;
+    calls = syscalls();
+    if (!r->unstripe) {
+        for (off = pos = 0; off < single_len; off += len, pos += n) {
+            len = single_len - off < step * r->num ? single_len - off
+                                                   : step * r->num;
+            start = now();
+            got = flash_stripe_feed(&fs, single + off, len, out);
+            r->seconds += now() - start;
+            if (got < 0) {
+                goto out;
+            }
+            n = got;
+            for (i = 0; i < r->num; ++i) {
+                r->ok &= pos + n <= plane_len &&
+                         !memcmp(out[i], planes[i] + pos, n);
+            }
+        }
+        start = now();
+        n = flash_stripe_flush(&fs, out);
+        r->seconds += now() - start;
+        for (i = 0; i < r->num; ++i) {
+            r->ok &= pos + n == plane_len &&
+                     !memcmp(out[i], planes[i] + pos, n);
+        }
+    } else {
+        for (off = pos = 0; off < plane_len; off += len, pos += n) {
+            len = plane_len - off < step ? plane_len - off : step;
+            for (i = 0; i < r->num; ++i) {
+                in[i] = planes[i] + off;
+            }
+            start = now();
+            got = flash_unstripe_feed(&fs, in, len, merged);
+            r->seconds += now() - start;
+            if (got < 0) {
+                goto out;
+            }
+            /* Only the image itself, not the padding of the last group */
+            n = len * r->num;
+            r->ok &= !memcmp(merged, single + pos,
+                             pos + n > single_len ? single_len - pos : n);
+        }
+    }
+    r->syscalls = calls < 0 ? -1 : syscalls() - calls - syscall_overhead;
+    ret = 0;
+out:
+    if (single) {
+        munmap(single, single_len);
+    }
+    for (i = 0; i < r->num; ++i) {
+        if (planes[i]) {
+            munmap(planes[i], plane_len);
+        }
+        free(out[i]);
+    }
+    free(merged);
+    return ret;
+}
+
+/*
+ * Time both directions of one mode with every selected engine. The stream
+ * engine first writes the reference files, "ref", that every other engine is
+ * checked against.
+ */
+static bool run_mode(const struct result *base, const bool *engines)
+{
+    char a[BENCH_PATH_MAX], b[BENCH_PATH_MAX];
+    struct result r;
+    enum engine e;
+    int dir, sparse;
+    bool ok = true;
+    int i;
+
+    for (dir = 0; dir < 2; ++dir) {
+        r = *base;
+        r.unstripe = dir;
+        r.engine = ENGINE_STREAM;
+        r.ok = !run_files(&r, dir ? "ref" : "in", "ref");
+        if (r.ok && dir) {
+            single_name(a, "in");
+            single_name(b, "ref");
+            r.ok = same_file(a, b, r.size);
+        }
+        if (engines[ENGINE_STREAM] || !r.ok) {
+            print_result(&r);
+        }
+        if (!r.ok) {
+            ok = false;
+            break;
+        }
+
+        for (e = 0; e < ENGINE_MAX; ++e) {
+            for (sparse = 0; sparse < 2; ++sparse) {
+                if (!engines[e] || (e == ENGINE_STREAM && !sparse) ||
+                    (e == ENGINE_PER_BYTE &&
+                     (sparse || r.size > per_byte_limit))) {
+                    continue;
+                }
+                r.engine = e;
+                r.sparse = sparse;
+                if (e == ENGINE_MEMORY) {
+                    r.ok = !run_memory(&r);
+                } else {
+                    r.ok = !run_files(&r, dir ? "ref" : "in", "run");
+                    for (i = 0; r.ok && !dir && i < r.num; ++i) {
+                        plane_name(a, "ref", i);
+                        plane_name(b, "run", i);
+                        r.ok = same_file(a, b, -1);
+                    }
+                    if (r.ok && dir) {
+                        single_name(a, "ref");
+                        single_name(b, "run");
+                        r.ok = same_file(a, b, -1);
+                    }
+                    remove_files("run", r.num);
+                }
+                print_result(&r);
+                ok &= r.ok;
+            }
+        }
+    }
+    remove_files("ref", base->num);
+    return ok;
+}
+
+/* Parse a size with an optional K, M or G suffix. 0 on error */
+static size_t parse_size(const char *s)
+{
+    char *end;
+    size_t v = strtoull(s, &end, 0);
+
+    switch (*end) {
+    case 'G':
+        v *= 1024;
+        /* fall through */
+    case 'M':
+        v *= 1024;
+        /* fall through */
+    case 'K':
+        v *= 1024;
+        end++;
+    }
+    return *end ? 0 : v;
+}
+
+/* Set flags for the names in a comma separated list. -1 on an unknown name */
+static int parse_names(char *list, const char **names, int max, bool *flags)
+{
+    char *tok;
+    int i;
+
+    memset(flags, 0, max * sizeof(*flags));
+    for (tok = strtok(list, ","); tok; tok = strtok(NULL, ",")) {
+        for (i = 0; i < max && strcmp(tok, names[i]); ++i) {
+        }
+        if (i == max) {
+            fprintf(stderr, "unknown name %s\n", tok);
+            return -1;
+        }
+        flags[i] = true;
+    }
+    return 0;
+}
+
+static void bench_usage(const char *exe_name)
+{
+    fprintf(stderr, "usage: %s [-s sizes] [-n nums] [-i images] [-E engines] "
+            "[-j threads] [-l per byte limit] [-d dir]\n"
+            "       %s -t\n", exe_name, exe_name);
+}
+
+int main(int argc, char *argv[])
+{
+    char *sizes_arg = NULL, *nums_arg = NULL;
+    char defaults_sizes[] = "1M,16M", defaults_nums[] = "2,4,8";
+    const char *tmp = "/tmp";
+    size_t sizes[BENCH_MAX_SIZES];
+    bool nums[BENCH_MAX_FILES + 1];
+    bool images[IMAGE_MAX];
+    bool engines[ENGINE_MAX];
+    char path[BENCH_PATH_MAX];
+    struct result base;
+    enum image image;
+    int num_sizes = 0;
+    bool test = false;
+    bool ok = true;
+    char *tok;
+    int mode;
+    int s, n;
+    int c;
+
+    memset(images, true, sizeof(images));
+    memset(engines, true, sizeof(engines));
+    while ((c = getopt(argc, argv, "s:n:i:E:j:l:d:t")) != -1) {
+        switch (c) {
+        case 's':
+            sizes_arg = optarg;
+            break;
+        case 'n':
+            nums_arg = optarg;
+            break;
+        case 'i':
+            if (parse_names(optarg, image_names, IMAGE_MAX, images)) {
+                return 1;
+            }
+            break;
+        case 'E':
+            if (parse_names(optarg, engine_names, ENGINE_MAX, engines)) {
+                return 1;
+            }
+            break;
+        case 'j':
+            jobs = atoi(optarg);
+            break;
+        case 'l':
+            per_byte_limit = parse_size(optarg);
+            break;
+        case 'd':
+            tmp = optarg;
+            break;
+        case 't':
+            test = true;
+            break;
+        default:
+            bench_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (!check_kernels()) {
+        return 1;
+    }
+    if (test) {
+        return 0;
+    }
+
+    for (tok = strtok(sizes_arg ? sizes_arg : defaults_sizes, ","); tok;
+         tok = strtok(NULL, ",")) {
+        if (num_sizes == BENCH_MAX_SIZES || !parse_size(tok)) {
+            bench_usage(argv[0]);
+            return 1;
+        }
+        sizes[num_sizes++] = parse_size(tok);
+    }
+    memset(nums, 0, sizeof(nums));
+    for (tok = strtok(nums_arg ? nums_arg : defaults_nums, ","); tok;
+         tok = strtok(NULL, ",")) {
+        n = atoi(tok);
+        if (n < 1 || n > BENCH_MAX_FILES) {
+            fprintf(stderr, "number of files must be 1 to %d\n",
+                    BENCH_MAX_FILES);
+            return 1;
+        }
+        nums[n] = true;
+    }
+    if (jobs < 1) {
+        bench_usage(argv[0]);
+        return 1;
+    }
+
+    /* Reading /proc/self/io counts too, take that out of every run */
+    syscall_overhead = syscalls();
+    syscall_overhead = syscalls() - syscall_overhead;
+    snprintf(dir, sizeof(dir), "%s/flash_stripe_bench.XXXXXX", tmp);
+    if (!mkdtemp(dir)) {
+        perror(dir);
+        return 1;
+    }
+    single_name(path, "in");
+
+    for (image = 0; ok && image < IMAGE_MAX; ++image) {
+        for (s = 0; images[image] && s < num_sizes; ++s) {
+            if (make_image(path, image, sizes[s])) {
+                ok = false;
+                break;
+            }
+            for (n = 1; n <= BENCH_MAX_FILES; ++n) {
+                /* bit wise then byte wise, each little then big endian */
+                for (mode = 0; nums[n] && mode < 4; ++mode) {
+                    memset(&base, 0, sizeof(base));
+                    base.image = image;
+                    base.size = sizes[s];
+                    base.num = n;
+                    base.bw = mode >> 1;
+                    base.be = mode & 1;
+                    ok &= run_mode(&base, engines);
+                }
+            }
+        }
+    }
+    printf("%s]\n", first_result ? "[" : "\n");
+
+    remove_files("in", 0);
+    if (rmdir(dir)) {
+        fprintf(stderr, "failed to remove %s: %s\n", dir, strerror(errno));
+    }
+    return !ok;
+}
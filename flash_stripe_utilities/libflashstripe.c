@@ -0,0 +1,779 @@
+/*
+ * Flash striping library: bit and byte striping kernels, a streaming
+ * context over caller owned buffers and the CRC32C used to check images.
+ *
+ * Copyright (c) 2013 Xilinx Inc
+ * Written by Peter Crosthwaite <peter.crosthwaite@xilinx.com>
+ *
+ * stripe8 function copied from QEMU source. GPL Lisence carried over:
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <string.h>
+
+#include "libflashstripe.h"
+
+/* N way (num) in place bit striper. Lay out row wise bits column wise
+ * (from element 0 to N-1). num is the length of x, and dir reverses the
+ * direction of the transform. be determines the bit endianess scheme.
+ * false to lay out bits LSB to MSB (little endian) and true for big endian.
+ *
+ * Best illustrated by examples:
+ * Each digit in the below array is a single bit (num == 3, be == false):
+ *
+ * {{ 76543210, }  ----- stripe (dir == false) -----> {{ FCheb630, }
+ *  { hgfedcba, }                                      { GDAfc741, }
+ *  { HGFEDCBA, }} <---- upstripe (dir == true) -----  { HEBgda52, }}
+ *
+ * Same but with be == true:
+ *
+ * {{ 76543210, }  ----- stripe (dir == false) -----> {{ 741gdaFC, }
+ *  { hgfedcba, }                                      { 630fcHEB, }
+ *  { HGFEDCBA, }} <---- upstripe (dir == true) -----  { 52hebGDA, }}
+ */
+
+void flash_stripe8(uint8_t *x, int num, bool dir, bool be)
+{
+    uint8_t r[num];
+    memset(r, 0, sizeof(uint8_t) * num);
+    int idx[2] = {0, 0};
+    int bit[2] = {0, be ? 7 : 0};
+    int d = dir;
+
+    for (idx[0] = 0; idx[0] < num; ++idx[0]) {
+        for (bit[0] = be ? 7 : 0; bit[0] != (be ? -1 : 8); bit[0] += be ? -1 : 1) {
+            r[idx[!d]] |= x[idx[d]] & 1 << bit[d] ? 1 << bit[!d] : 0;
+            idx[1] = (idx[1] + 1) % num;
+            if (!idx[1]) {
+                bit[1] += be ? -1 : 1;
+            }
+        }
+    }
+    memcpy(x, r, sizeof(uint8_t) * num);
+}
+
+/* Constant num lets the compiler fully unroll these for the common cases */
+static inline __attribute__((always_inline))
+void stripe_lookup(const struct flash_stripe_table *tbl,
+                   const uint8_t *single, uint8_t **planes, int num,
+                   size_t groups)
+{
+    size_t g;
+    int i;
+
+    for (g = 0; g < groups; ++g, single += num) {
+        uint64_t w = 0;
+
+        for (i = 0; i < num; ++i) {
+            w |= tbl->lane[i][single[i]];
+        }
+        for (i = 0; i < num; ++i) {
+            planes[i][g] = w >> (8 * i);
+        }
+    }
+}
+
+static inline __attribute__((always_inline))
+void unstripe_lookup(const struct flash_stripe_table *tbl,
+                     uint8_t **planes, uint8_t *single, int num,
+                     size_t groups)
+{
+    size_t g;
+    int i;
+
+    for (g = 0; g < groups; ++g, single += num) {
+        uint64_t w = 0;
+
+        for (i = 0; i < num; ++i) {
+            w |= tbl->lane[i][planes[i][g]];
+        }
+        for (i = 0; i < num; ++i) {
+            single[i] = w >> (8 * i);
+        }
+    }
+}
+
+/* Byte wise striping of 2, 4 and 8 files is a perfect shuffle. Each pass
+ * over num vectors splits every pair into its even and odd bytes, and
+ * log2(num) passes leave one vector of bytes per file. Unstriping runs the
+ * inverse zip the same number of times.
+ */
+#if defined(__SSE2__)
+#include <emmintrin.h>
+
+#define STRIPE_VEC_LEN 16
+typedef __m128i stripe_vec;
+
+static inline stripe_vec vec_load(const uint8_t *p)
+{
+    return _mm_loadu_si128((const __m128i *)p);
+}
+
+static inline void vec_store(uint8_t *p, stripe_vec v)
+{
+    _mm_storeu_si128((__m128i *)p, v);
+}
+
+static inline void vec_unzip(stripe_vec a, stripe_vec b, stripe_vec *even,
+                             stripe_vec *odd)
+{
+    const __m128i mask = _mm_set1_epi16(0x00ff);
+
+    *even = _mm_packus_epi16(_mm_and_si128(a, mask), _mm_and_si128(b, mask));
+    *odd = _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8));
+}
+
+static inline void vec_zip(stripe_vec a, stripe_vec b, stripe_vec *lo,
+                           stripe_vec *hi)
+{
+    *lo = _mm_unpacklo_epi8(a, b);
+    *hi = _mm_unpackhi_epi8(a, b);
+}
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+
+#define STRIPE_VEC_LEN 16
+typedef uint8x16_t stripe_vec;
+
+static inline stripe_vec vec_load(const uint8_t *p)
+{
+    return vld1q_u8(p);
+}
+
+static inline void vec_store(uint8_t *p, stripe_vec v)
+{
+    vst1q_u8(p, v);
+}
+
+static inline void vec_unzip(stripe_vec a, stripe_vec b, stripe_vec *even,
+                             stripe_vec *odd)
+{
+    uint8x16x2_t r = vuzpq_u8(a, b);
+
+    *even = r.val[0];
+    *odd = r.val[1];
+}
+
+static inline void vec_zip(stripe_vec a, stripe_vec b, stripe_vec *lo,
+                           stripe_vec *hi)
+{
+    uint8x16x2_t r = vzipq_u8(a, b);
+
+    *lo = r.val[0];
+    *hi = r.val[1];
+}
+#endif
+
+static inline __attribute__((always_inline))
+void stripe_bytes(const uint8_t *single, uint8_t **planes, int num,
+                  size_t groups)
+{
+    size_t g = 0;
+    int i;
+
+#ifdef STRIPE_VEC_LEN
+    if (num == 2 || num == 4 || num == 8) {
+        for (; g + STRIPE_VEC_LEN <= groups; g += STRIPE_VEC_LEN) {
+            stripe_vec v[num], t[num];
+            int pass;
+
+            for (i = 0; i < num; ++i) {
+                v[i] = vec_load(single + i * STRIPE_VEC_LEN);
+            }
+            for (pass = 1; pass < num; pass *= 2) {
+                for (i = 0; i < num / 2; ++i) {
+                    vec_unzip(v[2 * i], v[2 * i + 1], &t[i], &t[i + num / 2]);
+                }
+                memcpy(v, t, sizeof(v));
+            }
+            for (i = 0; i < num; ++i) {
+                vec_store(planes[i] + g, v[i]);
+            }
+            single += num * STRIPE_VEC_LEN;
+        }
+    }
+#endif
+
+    for (; g < groups; ++g, single += num) {
+        for (i = 0; i < num; ++i) {
+            planes[i][g] = single[i];
+        }
+    }
+}
+
+static inline __attribute__((always_inline))
+void unstripe_bytes(uint8_t **planes, uint8_t *single, int num, size_t groups)
+{
+    size_t g = 0;
+    int i;
+
+#ifdef STRIPE_VEC_LEN
+    if (num == 2 || num == 4 || num == 8) {
+        for (; g + STRIPE_VEC_LEN <= groups; g += STRIPE_VEC_LEN) {
+            stripe_vec v[num], t[num];
+            int pass;
+
+            for (i = 0; i < num; ++i) {
+                v[i] = vec_load(planes[i] + g);
+            }
+            for (pass = 1; pass < num; pass *= 2) {
+                for (i = 0; i < num / 2; ++i) {
+                    vec_zip(v[i], v[i + num / 2], &t[2 * i], &t[2 * i + 1]);
+                }
+                memcpy(v, t, sizeof(v));
+            }
+            for (i = 0; i < num; ++i) {
+                vec_store(single + i * STRIPE_VEC_LEN, v[i]);
+            }
+            single += num * STRIPE_VEC_LEN;
+        }
+    }
+#endif
+
+    for (; g < groups; ++g, single += num) {
+        for (i = 0; i < num; ++i) {
+            single[i] = planes[i][g];
+        }
+    }
+}
+
+/* Big endian byte wise striping runs the files in reverse order */
+static inline __attribute__((always_inline))
+void stripe_bytes_rev(const uint8_t *single, uint8_t **planes, int num,
+                      size_t groups)
+{
+    uint8_t *rev[num];
+    int i;
+
+    for (i = 0; i < num; ++i) {
+        rev[i] = planes[num - 1 - i];
+    }
+    stripe_bytes(single, rev, num, groups);
+}
+
+static inline __attribute__((always_inline))
+void unstripe_bytes_rev(uint8_t **planes, uint8_t *single, int num,
+                        size_t groups)
+{
+    uint8_t *rev[num];
+    int i;
+
+    for (i = 0; i < num; ++i) {
+        rev[i] = planes[num - 1 - i];
+    }
+    unstripe_bytes(rev, single, num, groups);
+}
+
+#define STRIPE_KERNELS(n, suffix)                                             \
+static void stripe_lookup_##suffix(const struct flash_stripe_table *tbl,      \
+                                   const uint8_t *single, uint8_t **planes,   \
+                                   size_t groups)                             \
+{                                                                             \
+    stripe_lookup(tbl, single, planes, n, groups);                            \
+}                                                                             \
+                                                                              \
+static void unstripe_lookup_##suffix(const struct flash_stripe_table *tbl,    \
+                                     uint8_t **planes, uint8_t *single,       \
+                                     size_t groups)                           \
+{                                                                             \
+    unstripe_lookup(tbl, planes, single, n, groups);                          \
+}                                                                             \
+                                                                              \
+static void stripe_bytes_##suffix(const struct flash_stripe_table *tbl,       \
+                                  const uint8_t *single, uint8_t **planes,    \
+                                  size_t groups)                              \
+{                                                                             \
+    (void)tbl;                                                                \
+    stripe_bytes(single, planes, n, groups);                                  \
+}                                                                             \
+                                                                              \
+static void unstripe_bytes_##suffix(const struct flash_stripe_table *tbl,     \
+                                    uint8_t **planes, uint8_t *single,        \
+                                    size_t groups)                            \
+{                                                                             \
+    (void)tbl;                                                                \
+    unstripe_bytes(planes, single, n, groups);                                \
+}                                                                             \
+                                                                              \
+static void stripe_bytes_rev_##suffix(const struct flash_stripe_table *tbl,   \
+                                      const uint8_t *single,                  \
+                                      uint8_t **planes, size_t groups)        \
+{                                                                             \
+    (void)tbl;                                                                \
+    stripe_bytes_rev(single, planes, n, groups);                              \
+}                                                                             \
+                                                                              \
+static void unstripe_bytes_rev_##suffix(const struct flash_stripe_table *tbl, \
+                                        uint8_t **planes, uint8_t *single,    \
+                                        size_t groups)                        \
+{                                                                             \
+    (void)tbl;                                                                \
+    unstripe_bytes_rev(planes, single, n, groups);                            \
+}
+
+STRIPE_KERNELS(2, 2)
+STRIPE_KERNELS(4, 4)
+STRIPE_KERNELS(8, 8)
+STRIPE_KERNELS(tbl->num, n)
+
+/* Bit striping groups too wide for the lookup tables */
+static void stripe8_block(const struct flash_stripe_table *tbl,
+                          const uint8_t *single, uint8_t **planes,
+                          size_t groups)
+{
+    int num = tbl->num;
+    uint8_t buf[num];
+    size_t g;
+    int i;
+
+    for (g = 0; g < groups; ++g) {
+        memcpy(buf, single + g * num, num);
+        flash_stripe8(buf, num, false, tbl->be);
+        for (i = 0; i < num; ++i) {
+            planes[i][g] = buf[i];
+        }
+    }
+}
+
+static void unstripe8_block(const struct flash_stripe_table *tbl,
+                            uint8_t **planes, uint8_t *single, size_t groups)
+{
+    int num = tbl->num;
+    uint8_t *buf;
+    size_t g;
+    int i;
+
+    for (g = 0; g < groups; ++g) {
+        buf = single + g * num;
+        for (i = 0; i < num; ++i) {
+            buf[i] = planes[i][g];
+        }
+        flash_stripe8(buf, num, true, tbl->be);
+    }
+}
+
+void flash_stripe_table_init(struct flash_stripe_table *tbl, int num,
+                             bool dir, bool be, bool bw)
+{
+    uint8_t x[FLASH_STRIPE_TABLE_MAX];
+    int i, j, v;
+
+    tbl->num = num;
+    tbl->be = be;
+    tbl->sparse = false;
+    tbl->holes = false;
+
+    if (bw && be) {
+        switch (num) {
+        case 2:
+            tbl->stripe = stripe_bytes_rev_2;
+            tbl->unstripe = unstripe_bytes_rev_2;
+            break;
+        case 4:
+            tbl->stripe = stripe_bytes_rev_4;
+            tbl->unstripe = unstripe_bytes_rev_4;
+            break;
+        case 8:
+            tbl->stripe = stripe_bytes_rev_8;
+            tbl->unstripe = unstripe_bytes_rev_8;
+            break;
+        default:
+            tbl->stripe = stripe_bytes_rev_n;
+            tbl->unstripe = unstripe_bytes_rev_n;
+        }
+        return;
+    } else if (bw) {
+        switch (num) {
+        case 2:
+            tbl->stripe = stripe_bytes_2;
+            tbl->unstripe = unstripe_bytes_2;
+            break;
+        case 4:
+            tbl->stripe = stripe_bytes_4;
+            tbl->unstripe = unstripe_bytes_4;
+            break;
+        case 8:
+            tbl->stripe = stripe_bytes_8;
+            tbl->unstripe = unstripe_bytes_8;
+            break;
+        default:
+            tbl->stripe = stripe_bytes_n;
+            tbl->unstripe = unstripe_bytes_n;
+        }
+        return;
+    }
+
+    if (num > FLASH_STRIPE_TABLE_MAX) {
+        tbl->stripe = stripe8_block;
+        tbl->unstripe = unstripe8_block;
+        return;
+    }
+
+    switch (num) {
+    case 2:
+        tbl->stripe = stripe_lookup_2;
+        tbl->unstripe = unstripe_lookup_2;
+        break;
+    case 4:
+        tbl->stripe = stripe_lookup_4;
+        tbl->unstripe = unstripe_lookup_4;
+        break;
+    case 8:
+        tbl->stripe = stripe_lookup_8;
+        tbl->unstripe = unstripe_lookup_8;
+        break;
+    default:
+        tbl->stripe = stripe_lookup_n;
+        tbl->unstripe = unstripe_lookup_n;
+    }
+
+    /* The lanes only hold the transform in the requested direction */
+    if (dir) {
+        tbl->stripe = NULL;
+    } else {
+        tbl->unstripe = NULL;
+    }
+
+    for (i = 0; i < num; ++i) {
+        for (v = 0; v < 256; ++v) {
+            memset(x, 0, num);
+            x[i] = v;
+            flash_stripe8(x, num, dir, be);
+            tbl->lane[i][v] = 0;
+            for (j = 0; j < num; ++j) {
+                tbl->lane[i][v] |= (uint64_t)x[j] << (8 * j);
+            }
+        }
+    }
+}
+
+/* The value of len bytes that are all 0x00 or all 0xff, otherwise -1 */
+static int uniform_byte(const uint8_t *p, size_t len)
+{
+    if ((p[0] == 0x00 || p[0] == 0xff) && !memcmp(p, p + 1, len - 1)) {
+        return p[0];
+    }
+    return -1;
+}
+
+void flash_stripe_chunk(const struct flash_stripe_table *tbl,
+                        const uint8_t *single, uint8_t **planes,
+                        size_t groups, bool *hole)
+{
+    int num = tbl->num;
+    uint8_t *sub[num];
+    size_t g, n;
+    int i, v;
+
+    if (!tbl->sparse) {
+        flash_stripe_block(tbl, single, planes, groups);
+        return;
+    }
+
+    for (g = 0; g < groups; g += n) {
+        n = groups - g < FLASH_STRIPE_SPARSE ? groups - g : FLASH_STRIPE_SPARSE;
+        v = uniform_byte(single + g * num, n * num);
+        hole[g / FLASH_STRIPE_SPARSE] = v == 0x00 && tbl->holes;
+        for (i = 0; i < num; ++i) {
+            sub[i] = planes[i] + g;
+            if (v != -1 && !hole[g / FLASH_STRIPE_SPARSE]) {
+                memset(sub[i], v, n);
+            }
+        }
+        if (v == -1) {
+            flash_stripe_block(tbl, single + g * num, sub, n);
+        }
+    }
+}
+
+void flash_unstripe_chunk(const struct flash_stripe_table *tbl,
+                          uint8_t **planes, uint8_t *single, size_t groups,
+                          bool *hole)
+{
+    int num = tbl->num;
+    uint8_t *sub[num];
+    size_t g, n;
+    int i, v;
+
+    if (!tbl->sparse) {
+        flash_unstripe_block(tbl, planes, single, groups);
+        return;
+    }
+
+    for (g = 0; g < groups; g += n) {
+        n = groups - g < FLASH_STRIPE_SPARSE ? groups - g : FLASH_STRIPE_SPARSE;
+        v = uniform_byte(planes[0] + g, n);
+        for (i = 0; i < num; ++i) {
+            sub[i] = planes[i] + g;
+            if (v != -1 && (sub[i][0] != v || uniform_byte(sub[i], n) != v)) {
+                v = -1;
+            }
+        }
+        hole[g / FLASH_STRIPE_SPARSE] = v == 0x00 && tbl->holes;
+        if (v == -1) {
+            flash_unstripe_block(tbl, sub, single + g * num, n);
+        } else if (!hole[g / FLASH_STRIPE_SPARSE]) {
+            memset(single + g * num, v, n * num);
+        }
+    }
+}
+
+
+int flash_stripe_init(struct flash_stripe *fs, int num, bool unstripe,
+                      bool be, bool bw, bool sparse)
+{
+    if (num < 1 || num > FLASH_STRIPE_MAX_FILES) {
+        return -1;
+    }
+    flash_stripe_table_init(&fs->tbl, num, unstripe, be, bw);
+    fs->tbl.sparse = sparse;
+    fs->unstripe = unstripe;
+    fs->pending_len = 0;
+    return 0;
+}
+
+ssize_t flash_stripe_feed(struct flash_stripe *fs, const uint8_t *in,
+                          size_t len, uint8_t *const *out)
+{
+    int num = fs->tbl.num;
+    bool hole[len / num / FLASH_STRIPE_SPARSE + 2];
+    uint8_t *planes[num];
+    size_t done = 0;
+    size_t groups;
+    int i;
+
+    /* Only the kernels for the direction fs was set up for are there */
+    if (fs->unstripe) {
+        return -1;
+    }
+
+    for (i = 0; i < num; ++i) {
+        planes[i] = out[i];
+    }
+
+    /* Complete the group held over from the last call first */
+    if (fs->pending_len) {
+        size_t n = num - fs->pending_len;
+
+        n = n < len ? n : len;
+        memcpy(fs->pending + fs->pending_len, in, n);
+        fs->pending_len += n;
+        in += n;
+        len -= n;
+        if (fs->pending_len < num) {
+            return 0;
+        }
+        flash_stripe_block(&fs->tbl, fs->pending, planes, 1);
+        fs->pending_len = 0;
+        for (i = 0; i < num; ++i) {
+            planes[i]++;
+        }
+        done = 1;
+    }
+
+    groups = len / num;
+    flash_stripe_chunk(&fs->tbl, in, planes, groups, hole);
+
+    fs->pending_len = len % num;
+    memcpy(fs->pending, in + groups * num, fs->pending_len);
+    return done + groups;
+}
+
+size_t flash_stripe_flush(struct flash_stripe *fs, uint8_t *const *out)
+{
+    uint8_t *planes[FLASH_STRIPE_MAX_FILES];
+    int i;
+
+    if (!fs->pending_len) {
+        return 0;
+    }
+    memset(fs->pending + fs->pending_len, 0xff,
+           fs->tbl.num - fs->pending_len);
+    for (i = 0; i < fs->tbl.num; ++i) {
+        planes[i] = out[i];
+    }
+    flash_stripe_block(&fs->tbl, fs->pending, planes, 1);
+    fs->pending_len = 0;
+    return 1;
+}
+
+int flash_unstripe_feed(struct flash_stripe *fs, const uint8_t *const *in,
+                        size_t len, uint8_t *out)
+{
+    bool hole[len / FLASH_STRIPE_SPARSE + 1];
+
+    if (!fs->unstripe) {
+        return -1;
+    }
+
+    /* The kernels only read the planes when unstriping */
+    flash_unstripe_chunk(&fs->tbl, (uint8_t **)in, out, len, hole);
+    return 0;
+}
+
+/* CRC32C (Castagnoli), reflected polynomial */
+#define CRC32C_POLY 0x82f63b78
+
+/* The SSE4.2 and ARMv8 CRC32 instructions implement CRC32C directly, build
+ * with -msse4.2 or -march=armv8-a+crc (or -march=native) to use them.
+ * Elsewhere the table driven version handles 8 bytes per step.
+ */
+#if defined(__SSE4_2__)
+#include <nmmintrin.h>
+
+uint32_t flash_stripe_crc32c(uint32_t crc, const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+    uint64_t c = ~crc;
+
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t v;
+
+        memcpy(&v, p, 8);
+        c = _mm_crc32_u64(c, v);
+    }
+    for (; len; --len) {
+        c = _mm_crc32_u8(c, *p++);
+    }
+    return ~(uint32_t)c;
+}
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+
+uint32_t flash_stripe_crc32c(uint32_t crc, const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+
+    crc = ~crc;
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t v;
+
+        memcpy(&v, p, 8);
+        crc = __crc32cd(crc, v);
+    }
+    for (; len; --len) {
+        crc = __crc32cb(crc, *p++);
+    }
+    return ~crc;
+}
+#else
+/* crc32c_table[k][v] is the CRC of byte v followed by k zero bytes */
+static uint32_t crc32c_table[8][256];
+
+static void __attribute__((constructor)) crc32c_init(void)
+{
+    uint32_t c;
+    int k, v;
+
+    for (v = 0; v < 256; ++v) {
+        c = v;
+        for (k = 0; k < 8; ++k) {
+            c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+        }
+        crc32c_table[0][v] = c;
+    }
+    for (v = 0; v < 256; ++v) {
+        for (k = 1; k < 8; ++k) {
+            c = crc32c_table[k - 1][v];
+            crc32c_table[k][v] = (c >> 8) ^ crc32c_table[0][c & 0xff];
+        }
+    }
+}
+
+uint32_t flash_stripe_crc32c(uint32_t crc, const void *buf, size_t len)
+{
+    const uint32_t (*t)[256] = crc32c_table;
+    const uint8_t *p = buf;
+
+    crc = ~crc;
+    for (; len >= 8; p += 8, len -= 8) {
+        crc ^= p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+        crc = t[7][crc & 0xff] ^ t[6][(crc >> 8) & 0xff] ^
+              t[5][(crc >> 16) & 0xff] ^ t[4][crc >> 24] ^
+              t[3][p[4]] ^ t[2][p[5]] ^ t[1][p[6]] ^ t[0][p[7]];
+    }
+    for (; len; --len) {
+        crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xff];
+    }
+    return ~crc;
+}
+#endif
+
+/* Multiply vec by the 32x32 GF(2) matrix mat, one column per word */
+static uint32_t gf2_times(const uint32_t *mat, uint32_t vec)
+{
+    uint32_t sum = 0;
+
+    for (; vec; vec >>= 1, ++mat) {
+        if (vec & 1) {
+            sum ^= *mat;
+        }
+    }
+    return sum;
+}
+
+static void gf2_square(uint32_t *square, const uint32_t *mat)
+{
+    int n;
+
+    for (n = 0; n < 32; ++n) {
+        square[n] = gf2_times(mat, mat[n]);
+    }
+}
+
+/* As zlib's crc32_combine: apply len2 zero bytes to crc1 by repeatedly
+ * squaring the one zero bit operator, then add crc2.
+ */
+uint32_t flash_stripe_crc32c_combine(uint32_t crc1, uint32_t crc2,
+                                     uint64_t len2)
+{
+    uint32_t even[32], odd[32];
+    uint32_t row = 1;
+    int n;
+
+    if (!len2) {
+        return crc1 ^ crc2;
+    }
+
+    odd[0] = CRC32C_POLY;
+    for (n = 1; n < 32; ++n, row <<= 1) {
+        odd[n] = row;
+    }
+    gf2_square(even, odd);      /* two zero bits */
+    gf2_square(odd, even);      /* four zero bits */
+
+    do {
+        gf2_square(even, odd);
+        if (len2 & 1) {
+            crc1 = gf2_times(even, crc1);
+        }
+        len2 >>= 1;
+        if (!len2) {
+            break;
+        }
+        gf2_square(odd, even);
+        if (len2 & 1) {
+            crc1 = gf2_times(odd, crc1);
+        }
+        len2 >>= 1;
+    } while (len2);
+
+    return crc1 ^ crc2;
+}
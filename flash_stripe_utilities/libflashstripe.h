@@ -0,0 +1,170 @@
+/*
+ * Flash striping library.
+ *
+ * Copyright (c) 2013 Xilinx Inc
+ * Written by Peter Crosthwaite <peter.crosthwaite@xilinx.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef LIBFLASHSTRIPE_H
+#define LIBFLASHSTRIPE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+/*
+ * Terminology: the single image is split into groups of num bytes, byte i of
+ * every group (after the bit transform) going to plane i, the contents of the
+ * i'th striped file. A plane therefore holds one byte per group.
+ */
+
+/* Widest group accepted by struct flash_stripe */
+#define FLASH_STRIPE_MAX_FILES 64
+
+/* Groups per sparse run, see flash_stripe_chunk */
+#define FLASH_STRIPE_SPARSE (16 * 1024)
+
+/* Bit striping is linear, so each byte of a group contributes to the result
+ * independently of the others. For groups of up to FLASH_STRIPE_TABLE_MAX
+ * bytes the contribution of every value of byte i is precomputed once (with
+ * flash_stripe8) as a word holding result byte j in bits 8j..8j+7, and a whole
+ * group then transforms with one table lookup and OR per byte.
+ *
+ * The kernel for the mode is picked once in flash_stripe_table_init, the block
+ * loops themselves never test the mode.
+ */
+#define FLASH_STRIPE_TABLE_MAX 8
+
+struct flash_stripe_table;
+
+typedef void (*flash_stripe_fn)(const struct flash_stripe_table *tbl,
+                                const uint8_t *single, uint8_t **planes,
+                                size_t groups);
+typedef void (*flash_unstripe_fn)(const struct flash_stripe_table *tbl,
+                                  uint8_t **planes, uint8_t *single,
+                                  size_t groups);
+
+struct flash_stripe_table {
+    int num;
+    bool be;
+    bool sparse;
+    bool holes;
+    flash_stripe_fn stripe;
+    flash_unstripe_fn unstripe;
+    uint64_t lane[FLASH_STRIPE_TABLE_MAX][256];
+};
+
+/* N way (num) in place bit striper, see libflashstripe.c */
+void flash_stripe8(uint8_t *x, int num, bool dir, bool be);
+
+/*
+ * Prepare tbl for num files. dir selects unstriping, be big endian bit order
+ * (or reversed file order with bw) and bw byte wise striping. Only the
+ * direction given is usable afterwards. sparse and holes start off false.
+ */
+void flash_stripe_table_init(struct flash_stripe_table *tbl, int num, bool dir,
+                             bool be, bool bw);
+
+/* Split groups of num bytes from single across the num planes */
+static inline void flash_stripe_block(const struct flash_stripe_table *tbl,
+                                      const uint8_t *single, uint8_t **planes,
+                                      size_t groups)
+{
+    tbl->stripe(tbl, single, planes, groups);
+}
+
+/* Merge one byte from each of the num planes into groups in single */
+static inline void flash_unstripe_block(const struct flash_stripe_table *tbl,
+                                        uint8_t **planes, uint8_t *single,
+                                        size_t groups)
+{
+    tbl->unstripe(tbl, planes, single, groups);
+}
+
+/*
+ * As flash_stripe_block and flash_unstripe_block, but with tbl->sparse set
+ * runs of FLASH_STRIPE_SPARSE groups that are all 0x00 or all 0xff are filled
+ * directly. With tbl->holes the zero runs are left untouched in the output
+ * and flagged in hole, one entry per run, for the caller to skip writing.
+ */
+void flash_stripe_chunk(const struct flash_stripe_table *tbl,
+                        const uint8_t *single, uint8_t **planes, size_t groups,
+                        bool *hole);
+void flash_unstripe_chunk(const struct flash_stripe_table *tbl,
+                          uint8_t **planes, uint8_t *single, size_t groups,
+                          bool *hole);
+
+/*
+ * Streaming context over caller owned buffers. Nothing is allocated after
+ * flash_stripe_init, so a context can sit on the stack or in a static.
+ */
+struct flash_stripe {
+    struct flash_stripe_table tbl;
+    bool unstripe;
+    int pending_len;
+    uint8_t pending[FLASH_STRIPE_MAX_FILES];
+};
+
+/*
+ * Set up fs for num files, 1 <= num <= FLASH_STRIPE_MAX_FILES. The flags are
+ * as for flash_stripe_table_init, sparse fills uniform runs directly. A
+ * context only works in the direction it was set up for: flash_stripe_feed
+ * and flash_stripe_flush when unstripe is false, flash_unstripe_feed when it
+ * is true. Returns 0, or -1 if num is out of range.
+ */
+int flash_stripe_init(struct flash_stripe *fs, int num, bool unstripe,
+                      bool be, bool bw, bool sparse);
+
+/*
+ * Stripe len bytes of the single image into the num buffers of out, each of
+ * which needs room for (len + num - 1) / num bytes. Bytes of an incomplete
+ * trailing group are held until the next call. Returns the number of bytes
+ * written to each out buffer, or -1 if fs was set up to unstripe.
+ */
+ssize_t flash_stripe_feed(struct flash_stripe *fs, const uint8_t *in,
+                          size_t len, uint8_t *const *out);
+
+/*
+ * Emit any held incomplete group, padded with 0xff, as one byte in each out
+ * buffer. Returns the number of bytes written to each, 0 or 1, always 0 if
+ * fs was set up to unstripe.
+ */
+size_t flash_stripe_flush(struct flash_stripe *fs, uint8_t *const *out);
+
+/*
+ * Unstripe len bytes from each of the num buffers of in into num * len bytes
+ * of out. Returns 0, or -1 if fs was set up to stripe.
+ */
+int flash_unstripe_feed(struct flash_stripe *fs, const uint8_t *const *in,
+                        size_t len, uint8_t *out);
+
+/*
+ * CRC32C of len bytes of buf, continuing from crc (0 to start). Uses the
+ * SSE4.2 or ARMv8 CRC instructions when built for them.
+ */
+uint32_t flash_stripe_crc32c(uint32_t crc, const void *buf, size_t len);
+
+/* CRC32C of A followed by B, given crc1 of A, crc2 of B and B's length */
+uint32_t flash_stripe_crc32c_combine(uint32_t crc1, uint32_t crc2,
+                                     uint64_t len2);
+
+#endif
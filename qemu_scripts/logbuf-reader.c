@@ -19,151 +19,1467 @@
  * SOFTWARE.
  */
 
-#include <stdlib.h>
-#include <stdio.h>
-#include <string.h>
-
-/*
- * Copied from the Linux Kernel.
- *
- * Example of a message structure:
- *   0000  ff 8f 00 00 00 00 00 00      monotonic time in nsec
- *   0008  34 00                        record is 52 bytes long
- *   000a        0b 00                  text is 11 bytes long
- *   000c              1f 00            dictionary is 23 bytes long
- *   000e                    03 00      LOG_KERN (facility) LOG_ERR (level)
- *   0010  69 74 27 73 20 61 20 6c      "it's a l"
- *         69 6e 65                     "ine"
- *   001b           44 45 56 49 43      "DEVIC"
- *         45 3d 62 38 3a 32 00 44      "E=b8:2\0D"
- *         52 49 56 45 52 3d 62 75      "RIVER=bu"
- *         67                           "g"
- *   0032     00 00 00                  padding to next message header
- */
-#define LOGBUF_MSG_MIN_LEN			16
-struct logbuf_msg {
-	unsigned long long m_time;
-	unsigned short record_len;
-	unsigned short text_len;
-	unsigned short dictionary_len;
-	unsigned short flags;
-	unsigned char* text;
-	unsigned char* dict;
-};
-
-struct logbuf_msg_state {
-	struct logbuf_msg msg;
-	char* raw_buffer;
-	unsigned int len;
-	unsigned int current_read;
-};
-
-int msg_read(int fd, struct logbuf_msg* state);
-
-#define WORD_ALIGN(x)	(((((x) % 4) == 0) ? ((x) / 4) : (((x) / 4) + 1)) * 4)
-//#define DEBUG
-#ifdef DEBUG
-#define DEBUGF(x, ...)	printf(x, __VA_ARGS__)
-#else
-#define DEBUGF(x, ...)	
-#endif
-
-struct logbuf_msg buffer[1024];
-
-int main(void)
-{
-	int fd = 0;
-	struct logbuf_msg* msg;
-	int ret = 0;
-	size_t count = 0;
-
-	while (1) {
-		msg = &(buffer[count]);
-		memset(msg, 0, sizeof(struct logbuf_msg));
-		ret = msg_read(fd, msg);
-		if (ret != -1) {
-			count++;
-		} else {
-			break;
-		}
-	}
-
-	int i;
-	for (i = 0; i < count; i++) {
-		printf("%s\n", buffer[i].text);
-	}
-
-	return 0;
-}
-
-int msg_read(int fd, struct logbuf_msg* state)
-{
-	if (state == NULL || fd < 0) {
-		return -1;
-	}
-
-	char buffer[1024];
-
-	/* read the header */
-	int ret = read(fd, buffer, LOGBUF_MSG_MIN_LEN);
-	if (ret >= 0 && ret == LOGBUF_MSG_MIN_LEN) {
-		state->m_time = *((unsigned long long*)buffer);
-		state->record_len = *((unsigned short*)(buffer+8));
-		state->text_len = *((unsigned short*)(buffer+10));
-		state->dictionary_len = *((unsigned short*)(buffer+12));
-		state->flags = *((unsigned short*)(buffer+14));
-
-		/* check endian, only need to swap when host/target
-		 * has a mis-match, e.g. x86->micrblaze be. */
-		if (state->text_len > state->record_len) {
-			unsigned short temp = state->text_len;
-			state->text_len = state->record_len;
-			state->record_len = state->text_len;
-			temp = state->dictionary_len;
-			state->dictionary_len = state->flags;
-			state->flags = state->dictionary_len;
-			/* TODO time */
-		}
-
-		DEBUGF("logbuf_msg (read %d bytes)\n", ret);
-		DEBUGF("\tstate->m_time = %016llx\n", state->m_time);
-		DEBUGF("\tstate->record_len = %08x\n", state->record_len);
-		DEBUGF("\tstate->text_len = %08x\n", state->text_len);
-		DEBUGF("\tstate->dictionary_len = %08x\n", state->dictionary_len);
-		DEBUGF("\tstate->flags = %08x\n", state->flags);
-	} else {
-		fprintf(stderr, "Corrupt logbuf, output may be incorrect\n");		
-		return -1;
-	}
-
-	/* read the rest */
-	size_t expected_read = WORD_ALIGN(state->record_len) - LOGBUF_MSG_MIN_LEN;
-	ret = read(fd, buffer, expected_read);
-	if (ret >= 0 && ret == expected_read) {
-		DEBUGF("\t\tread buffer, size = %d\n", ret);
-		size_t index = 0;
-		if (state->text_len > 0) {
-			state->text = malloc((state->text_len + 1) * sizeof(char));
-			memset(state->text, 0, (state->text_len + 1) * sizeof(char));
-			memcpy(state->text, &(buffer[index]), state->text_len);
-			index += state->text_len;
-			DEBUGF("\t\t\tstate->text = %s\n", state->text);
-		} else {
-			state->text = NULL;
-		}
-		if (state->dictionary_len > 0) {
-			state->dict = malloc((state->dictionary_len + 1) * sizeof(char));
-			memset(state->dict, 0, (state->dictionary_len + 1) * sizeof(char));
-			memcpy(state->dict, &(buffer[index]), state->dictionary_len);
-			index += state->dictionary_len;
-			DEBUGF("\t\t\tstate->dict = %s\n", state->dict);
-		} else {
-			state->dict = NULL;
-		}
-	} else {
-		fprintf(stderr, "Corrupt logbuf, output may be incorrect\n");
-		return -1;
-	}
-	return 0;
-}
-
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <time.h>
+#include <elf.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+ * Copied from the Linux Kernel.
+ *
+ * Example of a message structure:
+ *   0000  ff 8f 00 00 00 00 00 00      monotonic time in nsec
+ *   0008  34 00                        record is 52 bytes long
+ *   000a        0b 00                  text is 11 bytes long
+ *   000c              1f 00            dictionary is 23 bytes long
+ *   000e                    03 00      LOG_KERN (facility) LOG_ERR (level)
+ *   0010  69 74 27 73 20 61 20 6c      "it's a l"
+ *         69 6e 65                     "ine"
+ *   001b           44 45 56 49 43      "DEVIC"
+ *         45 3d 62 38 3a 32 00 44      "E=b8:2\0D"
+ *         52 49 56 45 52 3d 62 75      "RIVER=bu"
+ *         67                           "g"
+ *   0032     00 00 00                  padding to next message header
+ */
+#define LOGBUF_MSG_MIN_LEN			16
+struct logbuf_msg {
+	unsigned long long m_time;
+	unsigned short record_len;
+	unsigned short text_len;
+	unsigned short dictionary_len;
+	/* u8 facility; u8 flags:5; u8 level:3 in the kernel */
+	unsigned char facility;
+	unsigned char flags;
+	unsigned char level;
+	/* Views into the log buffer, not NUL terminated */
+	const unsigned char* text;
+	const unsigned char* dict;
+};
+
+typedef void (*msg_decode_fn)(const unsigned char* buffer,
+			      struct logbuf_msg* state);
+
+/* The kernel's own bookkeeping of the ring, see logbuf_ring_vars */
+enum logbuf_var {
+	LOGBUF_FIRST_SEQ,
+	LOGBUF_FIRST_IDX,
+	LOGBUF_NEXT_SEQ,
+	LOGBUF_NEXT_IDX,
+	LOGBUF_VARS,
+};
+
+/*
+ * The dumped log buffer. A regular file is mapped whole, anything else is
+ * streamed through a fixed window that always holds at least the current
+ * record. Records are parsed in place from here, so the views in a
+ * logbuf_msg are only valid until the next msg_read.
+ */
+struct logbuf {
+	const unsigned char* data;
+	size_t len;
+	size_t pos;
+	int fd;
+	/* fd has nothing more to read, it stays open for its owner to close */
+	int eof;
+	/* bytes read from fd so far, len only covers the window */
+	unsigned long long read_bytes;
+	int mapped;
+	void* map;
+	size_t map_len;
+	/* a mapped file is read once, what is before this has been let go */
+	size_t dropped;
+	/* 1 to byte swap the headers, 0 not to, -1 until the first is seen */
+	int swap;
+	msg_decode_fn decode;
+	/* ring mode, see logbuf_open_ring */
+	int ring;
+	int wrapped;
+	size_t first;
+	size_t next;
+	unsigned long long last_time;
+	/* records msg_read may still return, -1 for no limit */
+	long long remaining;
+	/* for locating other guest variables in the dump */
+	unsigned long long base;
+	/* where those of log_first_seq etc. that were given are, or NULL */
+	const unsigned char* var[LOGBUF_VARS];
+	/* log_next_seq when the ring was opened */
+	unsigned long long next_seq;
+};
+
+#define LOGBUF_IDX_UNKNOWN	((size_t)-1)
+
+/* getopt_long values of the options with no short form */
+#define LOGBUF_OPT_FIRST_SEQ	256
+#define LOGBUF_OPT_FIRST_IDX	257
+#define LOGBUF_OPT_NEXT_IDX	258
+
+/* Big enough for the largest record, record_len is 16 bits */
+#define LOGBUF_WINDOW		(128 * 1024)
+#define LOGBUF_OUT_BUF		(64 * 1024)
+/* How much of a mapped file is let go of at a time, a multiple of pages */
+#define LOGBUF_DROP		(4 * 1024 * 1024)
+
+struct msg_sink;
+
+int logbuf_open(int fd, struct logbuf* lb);
+int logbuf_open_ring(int fd, struct logbuf* lb, unsigned long long addr,
+		     size_t size, unsigned long long base, int big_endian,
+		     size_t first, size_t next);
+int logbuf_ring_vars(struct logbuf* lb,
+		     const unsigned long long addr[LOGBUF_VARS]);
+void logbuf_close(struct logbuf* lb);
+int logbuf_follow(struct logbuf* lb, struct msg_sink* sink,
+		  unsigned int interval_ms);
+int msg_read(struct logbuf* lb, struct logbuf_msg* state);
+
+#define WORD_ALIGN(x)	(((((x) % 4) == 0) ? ((x) / 4) : (((x) / 4) + 1)) * 4)
+//#define DEBUG
+#ifdef DEBUG
+#define DEBUGF(x, ...)	printf(x, __VA_ARGS__)
+#else
+#define DEBUGF(x, ...)	
+#endif
+
+/* Which records are written out, checked before any formatting */
+struct msg_filter {
+	/* m_time bounds in nsec, both inclusive */
+	unsigned long long since;
+	unsigned long long until;
+	/* the least severe level wanted, LOG_EMERG (0) to LOG_DEBUG (7) */
+	unsigned int level;
+};
+
+static struct msg_filter filter = { 0, ULLONG_MAX, 7 };
+
+static const char* const level_names[] = {
+	"emerg", "alert", "crit", "err", "warn", "notice", "info", "debug",
+};
+
+/*
+ * The binary output is a header, the magic "LBRC" and a 32 bit version
+ * (1), followed by blocks of up to LOGBUF_BIN_RECORDS records stored
+ * column by column. A block is
+ *
+ *   u32 count, u32 text_bytes, u32 dict_bytes
+ *   u64 time[count]            monotonic time in nsec
+ *   u8  level[count]
+ *   u8  facility[count]
+ *   u16 text_len[count]
+ *   u16 dict_len[count]
+ *   text_bytes of text, the records' text back to back
+ *   dict_bytes of dictionaries, as in the log buffer (NUL separated)
+ *
+ * all little endian whatever the guest or host. A block is also ended
+ * whenever the output is flushed, so following works record by record.
+ */
+#define LOGBUF_BIN_MAGIC	"LBRC"
+#define LOGBUF_BIN_VERSION	1
+#define LOGBUF_BIN_RECORDS	4096
+#define LOGBUF_BIN_BYTES	(1024 * 1024)
+
+struct bin_block {
+	uint32_t count;
+	uint32_t text_bytes;
+	uint32_t dict_bytes;
+	uint64_t time[LOGBUF_BIN_RECORDS];
+	uint8_t level[LOGBUF_BIN_RECORDS];
+	uint8_t facility[LOGBUF_BIN_RECORDS];
+	uint16_t text_len[LOGBUF_BIN_RECORDS];
+	uint16_t dict_len[LOGBUF_BIN_RECORDS];
+	unsigned char text[LOGBUF_BIN_BYTES];
+	unsigned char dict[LOGBUF_BIN_BYTES];
+};
+
+/* Where the records of one input go */
+struct msg_sink {
+	FILE* out;
+	/* the input, for the JSON "file" member when decoding several */
+	const char* name;
+	/* the block being filled, binary format only */
+	struct bin_block* bin;
+};
+
+static int host_big_endian(void);
+
+static void msg_print(struct msg_sink* sink, const struct logbuf_msg* msg)
+{
+	fwrite(msg->text, 1, msg->text_len, sink->out);
+	putc('\n', sink->out);
+}
+
+static void json_print_string(FILE* out, const unsigned char* s, size_t len)
+{
+	size_t i;
+
+	putc('"', out);
+	for (i = 0; i < len; i++) {
+		switch (s[i]) {
+		case '"':
+			fputs("\\\"", out);
+			break;
+		case '\\':
+			fputs("\\\\", out);
+			break;
+		case '\n':
+			fputs("\\n", out);
+			break;
+		case '\t':
+			fputs("\\t", out);
+			break;
+		default:
+			if (s[i] < 0x20 || s[i] == 0x7f) {
+				fprintf(out, "\\u%04x", s[i]);
+			} else {
+				putc(s[i], out);
+			}
+		}
+	}
+	putc('"', out);
+}
+
+/* One JSON object per line, the dictionary as an object of its KEY=value */
+static void msg_print_json(struct msg_sink* sink, const struct logbuf_msg* msg)
+{
+	FILE* out = sink->out;
+	const unsigned char* entry = msg->dict;
+	const unsigned char* end = msg->dict + msg->dictionary_len;
+	const unsigned char* eq;
+	const unsigned char* nul;
+	int first = 1;
+
+	putc('{', out);
+	if (sink->name) {
+		fputs("\"file\":", out);
+		json_print_string(out, (const unsigned char*)sink->name,
+				  strlen(sink->name));
+		putc(',', out);
+	}
+	fprintf(out, "\"time\":%llu.%06llu,\"level\":%u,\"facility\":%u,"
+		"\"text\":", msg->m_time / 1000000000ULL,
+		(msg->m_time % 1000000000ULL) / 1000, msg->level, msg->facility);
+	json_print_string(out, msg->text, msg->text_len);
+	fputs(",\"dict\":{", out);
+	while (entry < end) {
+		nul = memchr(entry, '\0', end - entry);
+		if (!nul) {
+			nul = end;
+		}
+		if (nul != entry) {
+			eq = memchr(entry, '=', nul - entry);
+			if (!eq) {
+				eq = nul;
+			}
+			if (!first) {
+				putc(',', out);
+			}
+			json_print_string(out, entry, eq - entry);
+			putc(':', out);
+			json_print_string(out, eq + (eq != nul),
+					  nul - eq - (eq != nul));
+			first = 0;
+		}
+		entry = nul + 1;
+	}
+	fputs("}}\n", out);
+}
+
+static uint32_t le32(uint32_t v)
+{
+	return host_big_endian() ? __builtin_bswap32(v) : v;
+}
+
+static void msg_flush_bin(struct msg_sink* sink)
+{
+	struct bin_block* bin = sink->bin;
+	uint32_t header[3];
+	uint32_t n = bin->count;
+	uint32_t i;
+
+	if (n == 0) {
+		return;
+	}
+	if (host_big_endian()) {
+		for (i = 0; i < n; i++) {
+			bin->time[i] = __builtin_bswap64(bin->time[i]);
+			bin->text_len[i] = __builtin_bswap16(bin->text_len[i]);
+			bin->dict_len[i] = __builtin_bswap16(bin->dict_len[i]);
+		}
+	}
+	header[0] = le32(n);
+	header[1] = le32(bin->text_bytes);
+	header[2] = le32(bin->dict_bytes);
+	fwrite(header, sizeof(header), 1, sink->out);
+	fwrite(bin->time, sizeof(bin->time[0]), n, sink->out);
+	fwrite(bin->level, sizeof(bin->level[0]), n, sink->out);
+	fwrite(bin->facility, sizeof(bin->facility[0]), n, sink->out);
+	fwrite(bin->text_len, sizeof(bin->text_len[0]), n, sink->out);
+	fwrite(bin->dict_len, sizeof(bin->dict_len[0]), n, sink->out);
+	fwrite(bin->text, 1, bin->text_bytes, sink->out);
+	fwrite(bin->dict, 1, bin->dict_bytes, sink->out);
+	bin->count = 0;
+	bin->text_bytes = 0;
+	bin->dict_bytes = 0;
+}
+
+static void msg_print_bin(struct msg_sink* sink, const struct logbuf_msg* msg)
+{
+	struct bin_block* bin = sink->bin;
+	uint32_t n;
+
+	if (bin->count == LOGBUF_BIN_RECORDS ||
+	    bin->text_bytes + msg->text_len > LOGBUF_BIN_BYTES ||
+	    bin->dict_bytes + msg->dictionary_len > LOGBUF_BIN_BYTES) {
+		msg_flush_bin(sink);
+	}
+	n = bin->count++;
+	bin->time[n] = msg->m_time;
+	bin->level[n] = msg->level;
+	bin->facility[n] = msg->facility;
+	bin->text_len[n] = msg->text_len;
+	bin->dict_len[n] = msg->dictionary_len;
+	memcpy(bin->text + bin->text_bytes, msg->text, msg->text_len);
+	bin->text_bytes += msg->text_len;
+	memcpy(bin->dict + bin->dict_bytes, msg->dict, msg->dictionary_len);
+	bin->dict_bytes += msg->dictionary_len;
+}
+
+static void (*msg_output)(struct msg_sink* sink,
+			  const struct logbuf_msg* msg) = msg_print;
+
+/* Set up a sink writing to out, -1 if there is no memory for it */
+static int msg_start(struct msg_sink* sink, FILE* out, const char* name)
+{
+	uint32_t version = le32(LOGBUF_BIN_VERSION);
+
+	sink->out = out;
+	sink->name = name;
+	sink->bin = NULL;
+	if (msg_output == msg_print_bin) {
+		sink->bin = calloc(1, sizeof(struct bin_block));
+		if (sink->bin == NULL) {
+			return -1;
+		}
+		fwrite(LOGBUF_BIN_MAGIC, 4, 1, out);
+		fwrite(&version, sizeof(version), 1, out);
+	}
+	return 0;
+}
+
+/* Write out a record that passes the filter in the chosen format */
+static void msg_emit(struct msg_sink* sink, const struct logbuf_msg* msg)
+{
+	if (msg->m_time < filter.since || msg->m_time > filter.until ||
+	    msg->level > filter.level) {
+		return;
+	}
+	msg_output(sink, msg);
+}
+
+/* Push out what is buffered, as a complete block for the binary format */
+static void msg_flush(struct msg_sink* sink)
+{
+	if (sink->bin) {
+		msg_flush_bin(sink);
+	}
+	fflush(sink->out);
+}
+
+static void msg_finish(struct msg_sink* sink)
+{
+	msg_flush(sink);
+	free(sink->bin);
+	sink->bin = NULL;
+}
+
+/* Seconds as dmesg prints them, e.g. 12.345678, to nsec */
+static int parse_time(const char* arg, unsigned long long* ns)
+{
+	char* end;
+	double secs = strtod(arg, &end);
+
+	if (end == arg || *end != '\0' || secs < 0) {
+		return -1;
+	}
+	*ns = (unsigned long long)(secs * 1e9 + 0.5);
+	return 0;
+}
+
+static int parse_level(const char* arg, unsigned int* level)
+{
+	char* end;
+	unsigned int i;
+
+	for (i = 0; i < sizeof(level_names) / sizeof(level_names[0]); i++) {
+		if (strcmp(arg, level_names[i]) == 0) {
+			*level = i;
+			return 0;
+		}
+	}
+	i = strtoul(arg, &end, 0);
+	if (end == arg || *end != '\0' || i > 7) {
+		return -1;
+	}
+	*level = i;
+	return 0;
+}
+
+static void usage(const char* exe_name)
+{
+	fprintf(stderr, "usage: %s [options] < logbuf\n"
+		"       %s [options] -a addr -s size [-b base] [-f first_idx] "
+		"[-n next_idx] [-B] [-F [-q seq_addr] [-i ms]]\n"
+		"           [--next-idx addr [--first-seq addr --first-idx addr]]"
+		" dump\n"
+		"  -a  physical address of __log_buf in the guest\n"
+		"  -s  size of __log_buf (log_buf_len)\n"
+		"  -b  physical address the dump starts at, for pmemsave dumps\n"
+		"  -f  log_first_idx, the offset of the oldest record\n"
+		"  -n  log_next_idx, the offset the next record goes at\n"
+		"  -B  big endian guest, for pmemsave dumps\n"
+		"  -F  keep following records as a running guest appends them,\n"
+		"      the dump being a memory-backend-file with share=on\n"
+		"  -q  physical address of log_next_seq, to follow exactly,\n"
+		"      with --next-idx that of log_next_idx\n"
+		"  --first-seq addr --first-idx addr  physical addresses of\n"
+		"      log_first_seq and log_first_idx, with -q to carry on\n"
+		"      from the oldest record should the guest overwrite\n"
+		"      records before they are read\n"
+		"  the guest's own log_first_idx and log_next_idx, when given,\n"
+		"  take the place of -f and -n\n"
+		"  -i  milliseconds between looks for new records (200)\n"
+		"       %s [options] [-j jobs] [-O dir] [-a addr -s size ...] "
+		"file...\n"
+		"  -j  decode the files on this many threads (one per CPU)\n"
+		"  -O  write each file's records to dir/<path with / as _>.<fmt>\n"
+		"      rather than to stdout in the order the files were given\n"
+		"options:\n"
+		"  -o, --format fmt  text (the default), json for JSON Lines\n"
+		"      or bin for binary columns, laid out as in the source\n"
+		"  -S, --since secs  only records from this time on\n"
+		"  -U, --until secs  only records up to this time\n"
+		"  -l, --level lvl   only records at this level or above, 0-7\n"
+		"      or emerg, alert, crit, err, warn, notice, info, debug\n",
+		exe_name, exe_name, exe_name);
+}
+
+/* How to find the records in each input, a whole file or a guest's ring */
+struct logbuf_input {
+	int ring;
+	unsigned long long addr;
+	size_t size;
+	unsigned long long base;
+	int big_endian;
+	size_t first;
+	size_t next;
+	/* guest physical addresses of log_first_seq etc., 0 if not given */
+	unsigned long long var[LOGBUF_VARS];
+};
+
+/*
+ * Open path for msg_read. The file stays open only when it has to be
+ * streamed, as lb->fd, and is left for the caller to close.
+ */
+static int logbuf_open_path(const struct logbuf_input* in, const char* path,
+			    struct logbuf* lb)
+{
+	int fd = open(path, O_RDONLY);
+	int ret;
+
+	if (fd == -1) {
+		perror(path);
+		return -1;
+	}
+	if (in->ring) {
+		ret = logbuf_open_ring(fd, lb, in->addr, in->size, in->base,
+				       in->big_endian, in->first, in->next);
+		if (ret == 0 && logbuf_ring_vars(lb, in->var) == -1) {
+			logbuf_close(lb);
+			ret = -1;
+		}
+	} else {
+		ret = logbuf_open(fd, lb);
+		if (ret == -1) {
+			perror(path);
+		}
+	}
+	if (ret == -1 || lb->fd != fd) {
+		close(fd);
+	}
+	return ret;
+}
+
+/* One input of a batch, see batch_run */
+struct batch_file {
+	const char* path;
+	/* the formatted records, when they go to stdout behind another file */
+	char* out;
+	size_t out_len;
+	unsigned long long bytes;
+	unsigned long long records;
+	int failed;
+	int done;
+};
+
+struct batch {
+	const struct logbuf_input* in;
+	const char* out_dir;
+	struct batch_file* files;
+	unsigned int num;
+	/* the next file for a worker to take, under lock */
+	unsigned int next;
+	/* the file whose records go to stdout now, see batch_direct */
+	unsigned int head;
+	pthread_mutex_t lock;
+	pthread_cond_t done;
+};
+
+static const char* batch_ext(void)
+{
+	if (msg_output == msg_print_json) {
+		return "json";
+	}
+	return msg_output == msg_print_bin ? "lbrc" : "txt";
+}
+
+/*
+ * Once bf is at the head of the queue, with all the files before it out,
+ * write what it has buffered so far to stdout and send the rest straight
+ * there. Returns the sink's new output.
+ */
+static FILE* batch_direct(struct batch* b, struct batch_file* bf,
+			  struct msg_sink* sink)
+{
+	FILE* out = sink->out;
+
+	if (out == stdout ||
+	    __atomic_load_n(&b->head, __ATOMIC_ACQUIRE) != bf - b->files) {
+		return out;
+	}
+	msg_flush(sink);
+	if (ferror(out) | fclose(out)) {
+		perror("memory");
+		bf->failed = 1;
+	}
+	fwrite(bf->out, 1, bf->out_len, stdout);
+	free(bf->out);
+	bf->out = NULL;
+	bf->out_len = 0;
+	sink->out = stdout;
+	return stdout;
+}
+
+static void batch_decode(struct batch* b, struct batch_file* bf)
+{
+	struct logbuf lb;
+	struct logbuf_msg msg;
+	struct msg_sink sink;
+	char name[4096];
+	char* p;
+	FILE* out;
+
+	if (logbuf_open_path(b->in, bf->path, &lb) == -1) {
+		bf->failed = 1;
+		return;
+	}
+	if (b->out_dir) {
+		snprintf(name, sizeof(name), "%s/%s.%s", b->out_dir, bf->path,
+			 batch_ext());
+		for (p = name + strlen(b->out_dir) + 1; *p; p++) {
+			if (*p == '/') {
+				*p = '_';
+			}
+		}
+		out = fopen(name, "w");
+	} else if (__atomic_load_n(&b->head, __ATOMIC_ACQUIRE) ==
+		   bf - b->files) {
+		out = stdout;
+		strcpy(name, "stdout");
+	} else {
+		/* behind a file still being decoded, until it is out */
+		out = open_memstream(&bf->out, &bf->out_len);
+		strcpy(name, "memory");
+	}
+	if (out == NULL) {
+		perror(name);
+		bf->failed = 1;
+		goto out_close;
+	}
+	/* with several files on stdout, say which each record came from */
+	if (!b->out_dir && b->num > 1 && msg_output == msg_print) {
+		fprintf(out, "==> %s <==\n", bf->path);
+	}
+	if (msg_start(&sink, out, !b->out_dir && b->num > 1 ?
+				  bf->path : NULL) == -1) {
+		perror(name);
+		bf->failed = 1;
+		if (out != stdout) {
+			fclose(out);
+		}
+		goto out_close;
+	}
+	while (msg_read(&lb, &msg) != -1) {
+		bf->records++;
+		msg_emit(&sink, &msg);
+		if (out != stdout && !b->out_dir) {
+			out = batch_direct(b, bf, &sink);
+		}
+	}
+	bf->bytes = lb.mapped ? lb.len : lb.read_bytes;
+	msg_finish(&sink);
+	if (out != stdout && (ferror(out) | fclose(out))) {
+		perror(name);
+		bf->failed = 1;
+	}
+out_close:
+	if (lb.fd != -1) {
+		close(lb.fd);
+	}
+	logbuf_close(&lb);
+}
+
+static void* batch_worker(void* opaque)
+{
+	struct batch* b = opaque;
+	unsigned int i;
+
+	while (1) {
+		pthread_mutex_lock(&b->lock);
+		i = b->next++;
+		pthread_mutex_unlock(&b->lock);
+		if (i >= b->num) {
+			break;
+		}
+		batch_decode(b, &b->files[i]);
+		pthread_mutex_lock(&b->lock);
+		b->files[i].done = 1;
+		pthread_cond_broadcast(&b->done);
+		pthread_mutex_unlock(&b->lock);
+	}
+	return NULL;
+}
+
+/*
+ * Decode many files on a pool of jobs threads, one file per thread at a
+ * time. The first file not yet out goes straight to stdout as it is
+ * decoded, the ones after it are formatted into memory until it is done,
+ * so the output matches a run per file in the order given and one file
+ * on its own streams. With out_dir each file gets its own output there
+ * instead. Throughput over the whole batch goes to stderr.
+ */
+static int batch_run(const struct logbuf_input* in, char* paths[],
+		     unsigned int num, unsigned int jobs, const char* out_dir)
+{
+	struct batch b = {
+		.in = in,
+		.out_dir = out_dir,
+		.num = num,
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.done = PTHREAD_COND_INITIALIZER,
+	};
+	pthread_t* threads;
+	struct timespec start, end;
+	unsigned long long bytes = 0, records = 0;
+	unsigned int failed = 0;
+	unsigned int started;
+	unsigned int i;
+	double secs;
+
+	b.files = calloc(num, sizeof(struct batch_file));
+	threads = calloc(jobs, sizeof(pthread_t));
+	if (b.files == NULL || threads == NULL) {
+		perror("batch");
+		free(b.files);
+		free(threads);
+		return 1;
+	}
+	for (i = 0; i < num; i++) {
+		b.files[i].path = paths[i];
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (started = 0; started < jobs; started++) {
+		if (pthread_create(&threads[started], NULL, batch_worker,
+				   &b) != 0) {
+			break;
+		}
+	}
+
+	for (i = 0; i < num; i++) {
+		if (started == 0) {
+			/* no threads to be had, decode here in turn */
+			batch_decode(&b, &b.files[i]);
+			b.files[i].done = 1;
+		}
+		pthread_mutex_lock(&b.lock);
+		while (!b.files[i].done) {
+			pthread_cond_wait(&b.done, &b.lock);
+		}
+		pthread_mutex_unlock(&b.lock);
+		if (b.files[i].out) {
+			fwrite(b.files[i].out, 1, b.files[i].out_len, stdout);
+			free(b.files[i].out);
+		}
+		/* stdout is the next file's now */
+		__atomic_store_n(&b.head, i + 1, __ATOMIC_RELEASE);
+		bytes += b.files[i].bytes;
+		records += b.files[i].records;
+		failed += b.files[i].failed;
+	}
+	for (i = 0; i < started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	fflush(stdout);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	if (secs <= 0) {
+		secs = 1e-9;
+	}
+	fprintf(stderr, "logbuf: %u files (%u failed), %llu records, "
+		"%.1f MiB in %.3f s on %u threads: %.1f MiB/s, "
+		"%.0f records/s\n", num, failed, records,
+		bytes / (1024.0 * 1024.0), secs, started ? started : 1,
+		bytes / (1024.0 * 1024.0) / secs, records / secs);
+
+	free(threads);
+	free(b.files);
+	return failed != 0 || ferror(stdout) != 0;
+}
+
+int main(int argc, char* argv[])
+{
+	struct logbuf lb;
+	struct logbuf_msg msg;
+	struct msg_sink sink;
+	struct logbuf_input in = {
+		.next = LOGBUF_IDX_UNKNOWN,
+	};
+	unsigned int interval_ms = 200;
+	unsigned int jobs = 0;
+	const char* out_dir = NULL;
+	int follow = 0;
+	int files;
+	int c;
+	static const struct option long_options[] = {
+		{ "format", required_argument, NULL, 'o' },
+		{ "since", required_argument, NULL, 'S' },
+		{ "until", required_argument, NULL, 'U' },
+		{ "level", required_argument, NULL, 'l' },
+		{ "first-seq", required_argument, NULL, LOGBUF_OPT_FIRST_SEQ },
+		{ "first-idx", required_argument, NULL, LOGBUF_OPT_FIRST_IDX },
+		{ "next-idx", required_argument, NULL, LOGBUF_OPT_NEXT_IDX },
+		{ NULL, 0, NULL, 0 },
+	};
+
+	while ((c = getopt_long(argc, argv, "a:s:b:f:n:BFq:i:j:O:o:S:U:l:",
+				long_options, NULL)) != -1) {
+		switch (c) {
+		case 'a':
+			in.addr = strtoull(optarg, NULL, 0);
+			in.ring = 1;
+			break;
+		case 's':
+			in.size = strtoull(optarg, NULL, 0);
+			break;
+		case 'b':
+			in.base = strtoull(optarg, NULL, 0);
+			break;
+		case 'f':
+			in.first = strtoull(optarg, NULL, 0);
+			break;
+		case 'n':
+			in.next = strtoull(optarg, NULL, 0);
+			break;
+		case 'B':
+			in.big_endian = 1;
+			break;
+		case 'F':
+			follow = 1;
+			break;
+		case 'q':
+			in.var[LOGBUF_NEXT_SEQ] = strtoull(optarg, NULL, 0);
+			break;
+		case LOGBUF_OPT_FIRST_SEQ:
+			in.var[LOGBUF_FIRST_SEQ] = strtoull(optarg, NULL, 0);
+			break;
+		case LOGBUF_OPT_FIRST_IDX:
+			in.var[LOGBUF_FIRST_IDX] = strtoull(optarg, NULL, 0);
+			break;
+		case LOGBUF_OPT_NEXT_IDX:
+			in.var[LOGBUF_NEXT_IDX] = strtoull(optarg, NULL, 0);
+			break;
+		case 'i':
+			interval_ms = strtoul(optarg, NULL, 0);
+			break;
+		case 'j':
+			jobs = strtoul(optarg, NULL, 0);
+			break;
+		case 'O':
+			out_dir = optarg;
+			break;
+		case 'o':
+			if (strcmp(optarg, "text") == 0) {
+				msg_output = msg_print;
+			} else if (strcmp(optarg, "json") == 0) {
+				msg_output = msg_print_json;
+			} else if (strcmp(optarg, "bin") == 0) {
+				msg_output = msg_print_bin;
+			} else {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'S':
+		case 'U':
+			if (parse_time(optarg, c == 'S' ? &filter.since :
+						   &filter.until) == -1) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'l':
+			if (parse_level(optarg, &filter.level) == -1) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	files = argc - optind;
+	if ((in.ring && (files == 0 || in.size == 0)) ||
+	    (follow && (!in.ring || files != 1 || jobs || out_dir)) ||
+	    (!in.var[LOGBUF_FIRST_SEQ] != !in.var[LOGBUF_FIRST_IDX]) ||
+	    (in.var[LOGBUF_FIRST_SEQ] && !in.var[LOGBUF_NEXT_SEQ]) ||
+	    (!in.var[LOGBUF_NEXT_SEQ] != !in.var[LOGBUF_NEXT_IDX])) {
+		usage(argv[0]);
+		return 1;
+	}
+	setvbuf(stdout, NULL, _IOFBF, LOGBUF_OUT_BUF);
+
+	if (files > 1 || (files == 1 && !in.ring) || jobs || out_dir) {
+		if (files == 0 ||
+		    (msg_output == msg_print_bin && !out_dir && files > 1)) {
+			usage(argv[0]);
+			return 1;
+		}
+		if (jobs == 0) {
+			jobs = sysconf(_SC_NPROCESSORS_ONLN);
+		}
+		if (jobs > (unsigned int)files) {
+			jobs = files;
+		}
+		return batch_run(&in, argv + optind, files, jobs, out_dir);
+	}
+
+	if (in.ring) {
+		if (logbuf_open_path(&in, argv[optind], &lb) == -1) {
+			return 1;
+		}
+	} else if (logbuf_open(0, &lb) == -1) {
+		perror("logbuf");
+		return 1;
+	}
+
+	/* each record is written out as soon as it is decoded */
+	if (msg_start(&sink, stdout, NULL) == -1) {
+		perror("logbuf");
+		return 1;
+	}
+	while (msg_read(&lb, &msg) != -1) {
+		msg_emit(&sink, &msg);
+	}
+	if (follow) {
+		/* only returns on error, otherwise runs until killed */
+		logbuf_follow(&lb, &sink, interval_ms);
+	}
+
+	logbuf_close(&lb);
+	msg_finish(&sink);
+	return ferror(stdout) != 0;
+}
+
+int logbuf_open(int fd, struct logbuf* lb)
+{
+	struct stat st;
+	unsigned char* data;
+
+	memset(lb, 0, sizeof(struct logbuf));
+	lb->fd = -1;
+	lb->swap = -1;
+
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+		data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data != MAP_FAILED) {
+			madvise(data, st.st_size, MADV_SEQUENTIAL);
+			lb->data = data;
+			lb->len = st.st_size;
+			lb->mapped = 1;
+			lb->map = data;
+			lb->map_len = st.st_size;
+			return 0;
+		}
+	}
+
+	lb->data = malloc(LOGBUF_WINDOW);
+	if (lb->data == NULL) {
+		return -1;
+	}
+	lb->fd = fd;
+	return 0;
+}
+
+/*
+ * Make at least need bytes from the current position available, when
+ * streaming. Returns the bytes available, fewer only at the end of input.
+ */
+static size_t logbuf_fill(struct logbuf* lb, size_t need)
+{
+	unsigned char* window = (unsigned char*)lb->data;
+	ssize_t ret;
+
+	if (lb->fd < 0 || lb->eof || lb->len - lb->pos >= need) {
+		return lb->len - lb->pos;
+	}
+
+	memmove(window, window + lb->pos, lb->len - lb->pos);
+	lb->len -= lb->pos;
+	lb->pos = 0;
+	while (lb->len < need) {
+		ret = read(lb->fd, window + lb->len, LOGBUF_WINDOW - lb->len);
+		if (ret == 0) {
+			lb->eof = 1;
+			break;
+		} else if (ret < 0) {
+			perror("logbuf");
+			lb->eof = 1;
+			break;
+		}
+		lb->len += ret;
+		lb->read_bytes += ret;
+	}
+	return lb->len;
+}
+
+static int host_big_endian(void)
+{
+	return __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__;
+}
+
+static unsigned short get16(const unsigned char* p, int swap)
+{
+	unsigned short v;
+
+	memcpy(&v, p, sizeof(v));
+	return swap ? __builtin_bswap16(v) : v;
+}
+
+static uint32_t get32(const unsigned char* p, int swap)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return swap ? __builtin_bswap32(v) : v;
+}
+
+static uint64_t get64(const unsigned char* p, int swap)
+{
+	uint64_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return swap ? __builtin_bswap64(v) : v;
+}
+
+/*
+ * The flags and level share a byte as bitfields, which the compiler lays
+ * out from the low bits on little endian targets and the high bits on big.
+ */
+static void msg_decode_flags(struct logbuf_msg* state,
+			     const unsigned char* buffer, int big_endian)
+{
+	state->facility = buffer[14];
+	if (big_endian) {
+		state->flags = buffer[15] >> 3;
+		state->level = buffer[15] & 0x7;
+	} else {
+		state->flags = buffer[15] & 0x1f;
+		state->level = buffer[15] >> 5;
+	}
+}
+
+/* Header decoders for each byte order, one is picked per buffer */
+static void msg_decode_native(const unsigned char* buffer,
+			      struct logbuf_msg* state)
+{
+	memcpy(&state->m_time, buffer, 8);
+	memcpy(&state->record_len, buffer + 8, 2);
+	memcpy(&state->text_len, buffer + 10, 2);
+	memcpy(&state->dictionary_len, buffer + 12, 2);
+	msg_decode_flags(state, buffer, host_big_endian());
+}
+
+static void msg_decode_swapped(const unsigned char* buffer,
+			       struct logbuf_msg* state)
+{
+	msg_decode_native(buffer, state);
+	state->m_time = __builtin_bswap64(state->m_time);
+	state->record_len = __builtin_bswap16(state->record_len);
+	state->text_len = __builtin_bswap16(state->text_len);
+	state->dictionary_len = __builtin_bswap16(state->dictionary_len);
+	msg_decode_flags(state, buffer, !host_big_endian());
+}
+
+static void logbuf_set_swap(struct logbuf* lb, int swap)
+{
+	lb->swap = swap;
+	lb->decode = swap ? msg_decode_swapped : msg_decode_native;
+}
+
+/*
+ * Whether the header holds up when read with the given byte order: the
+ * record is at least the header, text and dictionary, padded by less than
+ * LOG_ALIGN to a multiple of 4. A header read the wrong way round has the
+ * bytes of each length reversed, which almost never satisfies this.
+ */
+static int header_valid(const unsigned char* buffer, int swap)
+{
+	unsigned int record_len = get16(buffer + 8, swap);
+	unsigned int used = LOGBUF_MSG_MIN_LEN + get16(buffer + 10, swap) +
+			    get16(buffer + 12, swap);
+
+	return record_len % 4 == 0 && record_len >= used &&
+	       record_len - used < 8;
+}
+
+/*
+ * Pick the byte order of a buffer of unknown origin from its first header,
+ * e.g. a MicroBlaze big endian log read on x86. Native wins a tie, or when
+ * neither fits, to report the corruption as before.
+ */
+static int logbuf_detect_swap(const unsigned char* buffer)
+{
+	return !header_valid(buffer, 0) && header_valid(buffer, 1);
+}
+
+/*
+ * Find the file offset of size bytes at guest physical address addr in an
+ * ELF core from dump-guest-memory, from its PT_LOAD headers. Also sets
+ * big_endian from the core. Returns -1 if no segment holds the range.
+ */
+static long long elf_locate(const unsigned char* map, size_t len,
+			    unsigned long long addr, size_t size,
+			    int* big_endian)
+{
+	int is64 = map[EI_CLASS] == ELFCLASS64;
+	int swap = (map[EI_DATA] == ELFDATA2MSB) != host_big_endian();
+	size_t ehdr = is64 ? sizeof(Elf64_Ehdr) : sizeof(Elf32_Ehdr);
+	size_t phdr = is64 ? sizeof(Elf64_Phdr) : sizeof(Elf32_Phdr);
+	unsigned long long phoff, offset, paddr, filesz;
+	unsigned int phnum, i;
+
+	*big_endian = map[EI_DATA] == ELFDATA2MSB;
+	if (len < ehdr) {
+		return -1;
+	}
+	if (is64) {
+		phoff = get64(map + offsetof(Elf64_Ehdr, e_phoff), swap);
+		phnum = get16(map + offsetof(Elf64_Ehdr, e_phnum), swap);
+	} else {
+		phoff = get32(map + offsetof(Elf32_Ehdr, e_phoff), swap);
+		phnum = get16(map + offsetof(Elf32_Ehdr, e_phnum), swap);
+	}
+
+	for (i = 0; i < phnum; i++) {
+		const unsigned char* ph = map + phoff + i * phdr;
+
+		if (phoff + (i + 1) * phdr > len) {
+			break;
+		}
+		if (is64) {
+			if (get32(ph + offsetof(Elf64_Phdr, p_type), swap) !=
+			    PT_LOAD) {
+				continue;
+			}
+			offset = get64(ph + offsetof(Elf64_Phdr, p_offset), swap);
+			paddr = get64(ph + offsetof(Elf64_Phdr, p_paddr), swap);
+			filesz = get64(ph + offsetof(Elf64_Phdr, p_filesz), swap);
+		} else {
+			if (get32(ph + offsetof(Elf32_Phdr, p_type), swap) !=
+			    PT_LOAD) {
+				continue;
+			}
+			offset = get32(ph + offsetof(Elf32_Phdr, p_offset), swap);
+			paddr = get32(ph + offsetof(Elf32_Phdr, p_paddr), swap);
+			filesz = get32(ph + offsetof(Elf32_Phdr, p_filesz), swap);
+		}
+		if (addr >= paddr && addr + size <= paddr + filesz) {
+			return offset + (addr - paddr);
+		}
+	}
+	return -1;
+}
+
+/*
+ * File offset of size bytes at guest physical address addr, in an ELF core
+ * or a raw dump starting at base. -1 if the dump doesn't hold them.
+ */
+static long long dump_locate(const unsigned char* map, size_t len,
+			     unsigned long long addr, size_t size,
+			     unsigned long long base, int* big_endian)
+{
+	long long off;
+
+	if (len >= SELFMAG && memcmp(map, ELFMAG, SELFMAG) == 0) {
+		off = elf_locate(map, len, addr, size, big_endian);
+	} else {
+		off = addr >= base ? (long long)(addr - base) : -1;
+	}
+	if (off < 0 || off + size > len) {
+		return -1;
+	}
+	return off;
+}
+
+/*
+ * Map a guest RAM dump and decode the kernel log ring at guest physical
+ * address addr, size bytes long. The dump is either an ELF core from
+ * dump-guest-memory, which knows its own endianness and layout, or raw
+ * memory from pmemsave starting at physical address base.
+ *
+ * Records run from first to next, wrapping to the start of the ring at a
+ * zero length record or when no header fits before the end. Without next
+ * (log_next_idx) the walk stops at the first zero length record that
+ * follows a wrap, or at the first when first is 0, or at a record older than
+ * the one before as that is left over from before the ring last wrapped.
+ */
+int logbuf_open_ring(int fd, struct logbuf* lb, unsigned long long addr,
+		     size_t size, unsigned long long base, int big_endian,
+		     size_t first, size_t next)
+{
+	struct stat st;
+	unsigned char* map;
+	long long off;
+
+	memset(lb, 0, sizeof(struct logbuf));
+	lb->fd = -1;
+
+	if (fstat(fd, &st) == -1 || st.st_size == 0) {
+		fprintf(stderr, "Can't size guest memory dump\n");
+		return -1;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+
+	off = dump_locate(map, st.st_size, addr, size, base, &big_endian);
+	if (off < 0 ||
+	    first >= size || (next != LOGBUF_IDX_UNKNOWN && next > size)) {
+		fprintf(stderr, "__log_buf is not within the dump\n");
+		munmap(map, st.st_size);
+		return -1;
+	}
+
+	lb->map = map;
+	lb->map_len = st.st_size;
+	lb->mapped = 1;
+	lb->data = map + off;
+	lb->len = size;
+	logbuf_set_swap(lb, big_endian != host_big_endian());
+	lb->ring = 1;
+	lb->first = first;
+	lb->pos = first;
+	lb->next = next;
+	lb->remaining = -1;
+	lb->base = base;
+	return 0;
+}
+
+static const char* const logbuf_var_names[LOGBUF_VARS] = {
+	"log_first_seq", "log_first_idx", "log_next_seq", "log_next_idx",
+};
+
+/* u64 sequence numbers and u32 indices */
+static const size_t logbuf_var_sizes[LOGBUF_VARS] = { 8, 4, 8, 4 };
+
+static unsigned long long logbuf_var(const struct logbuf* lb,
+				     enum logbuf_var var)
+{
+	if (logbuf_var_sizes[var] == 8) {
+		return get64(lb->var[var], lb->swap);
+	}
+	return get32(lb->var[var], lb->swap);
+}
+
+/*
+ * Find the kernel's variables for the ring in the dump, from their guest
+ * physical addresses in addr (0 for those not wanted), so that
+ * logbuf_var can read them as the guest updates them.
+ *
+ * Their values now bound the records msg_read returns, in place of the
+ * first and next given to logbuf_open_ring, so that records a running
+ * guest appends while these are decoded are left for logbuf_follow. The
+ * next ones are read first: the kernel only moves log_first_idx on to make
+ * room for a record before it moves log_next_idx past that record.
+ */
+int logbuf_ring_vars(struct logbuf* lb,
+		     const unsigned long long addr[LOGBUF_VARS])
+{
+	unsigned long long first_seq;
+	int big_endian;
+	long long off;
+	int i;
+
+	for (i = 0; i < LOGBUF_VARS; i++) {
+		if (addr[i] == 0) {
+			continue;
+		}
+		off = dump_locate(lb->map, lb->map_len, addr[i],
+				  logbuf_var_sizes[i], lb->base, &big_endian);
+		if (off < 0) {
+			fprintf(stderr, "%s is not within the dump\n",
+				logbuf_var_names[i]);
+			return -1;
+		}
+		lb->var[i] = (const unsigned char*)lb->map + off;
+	}
+
+	if (lb->var[LOGBUF_NEXT_SEQ]) {
+		lb->next_seq = logbuf_var(lb, LOGBUF_NEXT_SEQ);
+	}
+	if (lb->var[LOGBUF_NEXT_IDX]) {
+		lb->next = logbuf_var(lb, LOGBUF_NEXT_IDX);
+	}
+	if (lb->var[LOGBUF_FIRST_IDX]) {
+		lb->first = logbuf_var(lb, LOGBUF_FIRST_IDX);
+		lb->pos = lb->first;
+	}
+	if (lb->var[LOGBUF_FIRST_SEQ]) {
+		first_seq = logbuf_var(lb, LOGBUF_FIRST_SEQ);
+		lb->remaining = lb->next_seq > first_seq ?
+				lb->next_seq - first_seq : 0;
+	}
+	if (lb->first >= lb->len ||
+	    (lb->next != LOGBUF_IDX_UNKNOWN && lb->next > lb->len)) {
+		fprintf(stderr, "log_first_idx or log_next_idx is outside "
+			"the ring\n");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Follow a running guest, decoding records as they are appended after the
+ * ones already read. The dump is a shared mapping of the guest RAM file, so
+ * each look only reads the header at the current position (and the ring's
+ * variables) rather than the whole buffer.
+ *
+ * With log_next_seq exactly the records the kernel has finished are
+ * decoded. Should the kernel overwrite records before they are read,
+ * log_first_seq and log_first_idx tell how many were lost and where the
+ * oldest record left is, and following carries on from there. Without them
+ * the records that could not be found are looked for again each time.
+ * Without log_next_seq a record counts as appended once its header is
+ * valid and no older than the last one read.
+ */
+int logbuf_follow(struct logbuf* lb, struct msg_sink* sink,
+		  unsigned int interval_ms)
+{
+	struct timespec interval = {
+		.tv_sec = interval_ms / 1000,
+		.tv_nsec = (interval_ms % 1000) * 1000000L,
+	};
+	struct logbuf_msg msg;
+	/* the sequence number of the record at lb->pos */
+	unsigned long long seq = 0;
+	unsigned long long next_seq = 0, first_seq;
+	size_t first_idx;
+	int progress;
+
+	if (lb->var[LOGBUF_NEXT_SEQ]) {
+		/* on from where the guest was when opened, not from now */
+		if (lb->remaining > 0) {
+			seq = lb->next_seq - lb->remaining;
+		} else {
+			seq = lb->next_seq;
+			lb->pos = lb->next;
+		}
+	}
+
+	/* from here on only the time ordering or the sequence bounds a walk */
+	lb->next = LOGBUF_IDX_UNKNOWN;
+	while (1) {
+		msg_flush(sink);
+		nanosleep(&interval, NULL);
+
+		if (lb->var[LOGBUF_NEXT_SEQ]) {
+			next_seq = logbuf_var(lb, LOGBUF_NEXT_SEQ);
+			first_seq = lb->var[LOGBUF_FIRST_SEQ] ?
+				    logbuf_var(lb, LOGBUF_FIRST_SEQ) : seq;
+			if (first_seq > seq) {
+				/* lapped, carry on from the oldest record */
+				first_idx = logbuf_var(lb, LOGBUF_FIRST_IDX);
+				if (first_idx >= lb->len) {
+					fprintf(stderr, "log_first_idx %zu is "
+						"outside the ring\n", first_idx);
+					return -1;
+				}
+				fprintf(stderr, "logbuf: %llu records lost\n",
+					first_seq - seq);
+				lb->pos = first_idx;
+				seq = first_seq;
+			}
+			lb->remaining = next_seq - seq;
+		}
+		/* a walk stops where it started, go again past a wrap */
+		do {
+			progress = 0;
+			lb->first = lb->pos;
+			lb->wrapped = 0;
+			while (msg_read(lb, &msg) != -1) {
+				msg_emit(sink, &msg);
+				progress = 1;
+			}
+		} while (progress && lb->remaining != 0);
+		if (lb->var[LOGBUF_NEXT_SEQ]) {
+			seq = next_seq - lb->remaining;
+		}
+	}
+	return 0;
+}
+
+/*
+ * At the end of the ring data, or its wrap point, move to the start of the
+ * ring. Returns 0 with a record to decode at lb->pos, -1 at the end.
+ */
+static int logbuf_ring_wrap(struct logbuf* lb)
+{
+	if (lb->pos == lb->next || (lb->wrapped && lb->pos >= lb->first)) {
+		return -1;
+	}
+	if (lb->len - lb->pos >= LOGBUF_MSG_MIN_LEN &&
+	    get16(lb->data + lb->pos + 8, lb->swap) != 0) {
+		return 0;
+	}
+	if (lb->wrapped || (lb->first == 0 && lb->next == LOGBUF_IDX_UNKNOWN)) {
+		return -1;
+	}
+	/* without log_next_idx, only wrap once the start has been rewritten */
+	if (lb->next == LOGBUF_IDX_UNKNOWN && lb->remaining < 0 &&
+	    get64(lb->data, lb->swap) < lb->last_time) {
+		return -1;
+	}
+	lb->wrapped = 1;
+	lb->pos = 0;
+	return lb->first == 0 ? -1 : logbuf_ring_wrap(lb);
+}
+
+void logbuf_close(struct logbuf* lb)
+{
+	if (lb->mapped) {
+		munmap(lb->map, lb->map_len);
+	} else {
+		free((void*)lb->data);
+	}
+	memset(lb, 0, sizeof(struct logbuf));
+}
+
+int msg_read(struct logbuf* lb, struct logbuf_msg* state)
+{
+	if (state == NULL || lb == NULL) {
+		return -1;
+	}
+
+	if (lb->ring && (lb->remaining == 0 || logbuf_ring_wrap(lb) == -1)) {
+		return -1;
+	}
+
+	/* the last record's views go now anyway, so keep RSS flat */
+	if (lb->mapped && !lb->ring && lb->pos - lb->dropped >= LOGBUF_DROP) {
+		size_t end = lb->pos - lb->pos % LOGBUF_DROP;
+
+		madvise((unsigned char*)lb->map + lb->dropped, end - lb->dropped,
+			MADV_DONTNEED);
+		lb->dropped = end;
+	}
+
+	size_t avail = logbuf_fill(lb, LOGBUF_MSG_MIN_LEN);
+	const unsigned char* buffer = lb->data + lb->pos;
+
+	/* a clean end of the buffer */
+	if (avail == 0) {
+		return -1;
+	}
+
+	/* the header */
+	if (avail >= LOGBUF_MSG_MIN_LEN) {
+		/* check endian once, only need to swap when host/target
+		 * has a mis-match, e.g. x86->micrblaze be. */
+		if (lb->swap == -1) {
+			logbuf_set_swap(lb, logbuf_detect_swap(buffer));
+		}
+		lb->decode(buffer, state);
+
+		if (lb->ring && lb->next == LOGBUF_IDX_UNKNOWN &&
+		    state->m_time < lb->last_time) {
+			return -1;
+		}
+
+		DEBUGF("logbuf_msg (at %zu)\n", lb->pos);
+		DEBUGF("\tstate->m_time = %016llx\n", state->m_time);
+		DEBUGF("\tstate->record_len = %08x\n", state->record_len);
+		DEBUGF("\tstate->text_len = %08x\n", state->text_len);
+		DEBUGF("\tstate->dictionary_len = %08x\n", state->dictionary_len);
+		DEBUGF("\tstate->facility = %u level = %u flags = %02x\n",
+		       state->facility, state->level, state->flags);
+	} else {
+		fprintf(stderr, "Corrupt logbuf, output may be incorrect\n");
+		return -1;
+	}
+
+	/* the rest, text then dictionary, must fit in the record */
+	size_t record_len = WORD_ALIGN(state->record_len);
+	avail = logbuf_fill(lb, record_len);
+	buffer = lb->data + lb->pos;
+	if (state->record_len < LOGBUF_MSG_MIN_LEN ||
+	    record_len > avail ||
+	    (size_t)LOGBUF_MSG_MIN_LEN + state->text_len +
+	    state->dictionary_len > record_len ||
+	    (lb->ring && !header_valid(buffer, lb->swap))) {
+		/* without log_next_idx this is where the live records end */
+		if (!lb->ring || lb->next != LOGBUF_IDX_UNKNOWN) {
+			fprintf(stderr,
+				"Corrupt logbuf, output may be incorrect\n");
+		}
+		return -1;
+	}
+
+	state->text = state->text_len ? buffer + LOGBUF_MSG_MIN_LEN : NULL;
+	state->dict = state->dictionary_len ?
+		buffer + LOGBUF_MSG_MIN_LEN + state->text_len : NULL;
+	DEBUGF("\t\t\tstate->text = %.*s\n", state->text_len, state->text);
+	DEBUGF("\t\t\tstate->dict = %.*s\n", state->dictionary_len,
+	       state->dict);
+
+	lb->pos += record_len;
+	lb->last_time = state->m_time;
+	if (lb->remaining > 0) {
+		lb->remaining--;
+	}
+	return 0;
+}